@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -10,97 +11,834 @@
 #include "types.h"
 #include <stdbool.h>
 #include <string.h>  
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <errno.h>
 
-#define BLK_SZ (BSIZE) // Define block size
 #define CHK_BIT(bmp, addr) ((*(bmp + addr / 8)) & (bits[addr % 8])) // Macro to check if a bit is set in a bitmap
+#define CNT_PER_WORD 32 // 2-bit usage counters packed per 64-bit word
+#define CNT_DUP_MASK 0xAAAAAAAAAAAAAAAAULL // High bit of every 2-bit counter
+#define DIRECT_SLOTS(n) ((1u << (n)) - 1) // Direct slots in a mask over addrs[]
+#define VLANES 4 // Lanes of vuint
+#define MAXLEVELS 4 // Deepest tree of indirect blocks, one per indirect slot of addrs[]
+#define PF_AHEAD 2 // Indirect blocks prefetched ahead of the one being descended into
+#define FIT_SAMPLE 4096 // Inodes geo_fit() compares with their sizes
+#define FSMAGIC 0x10203040 // Leads the superblock of images made by the RISC-V port
+#define FSMAGIC64 0x1020304000000064ULL // Leads the superblock of the 64-bit address format
+#define UNDO_MAGIC "fckundo1" // Leads an undo journal
+#define COMPACT_WINDOW (16 << 20) // Bytes fcheck compact gathers before each write
+#define INDEX_MAGIC "fckidx01" // Leads a block ownership index
 
 char bits[8] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 }; // Bitmask for checking individual bits
 
+// Vector of unsigned lanes, lowered by the compiler to the target's SIMD registers
+typedef uint vuint __attribute__((vector_size(VLANES * sizeof(uint))));
+
+// Check levels, each including the ones before it. Costs are in terms of the image's
+// metadata, never its file data:
+//   TIER_QUICK     superblock geometry, bitmap popcount against the block count implied
+//                  by inode sizes, and root directory sanity. Reads the inode table, the
+//                  bitmap and the root directory: milliseconds even on multi-GB images.
+//   TIER_STANDARD  inode types, addresses, sizes, bitmap and duplicate-address checks.
+//                  Adds every indirect block and every directory's first blocks. The
+//                  bitmap is checked block by block instead of by popcount.
+//   TIER_FULL      directory graph walk and reference count reconciliation. Adds every
+//                  directory block, visited in directory order.
+enum { TIER_QUICK, TIER_STANDARD, TIER_FULL };
+
 // Structure to represent an entry in a directory
 typedef struct {
   struct dinode *in;
   int nextIdx;
 } Entry;
 
-// Structure to hold image data
+// On-disk geometry of an image: the block size, the width of a block address and the
+// number of direct and indirect slots in addrs[], along with the sizes derived from them
+// by set_geo(). Indirect slot k, addrs[ndirect + k], heads a tree of indirect blocks
+// k + 1 levels deep.
+typedef struct {
+  uint bsize;
+  uint bshift;    // log2 of bsize
+  uint asize;     // Bytes per block address: 4, or 8 in the 64-bit address format
+  uint aoff;      // Offset of addrs[] in a dinode
+  uint ndirect;
+  uint nlevels;   // Indirect slots
+  uint nindirect; // Addresses per indirect block
+  uint64_t span[MAXLEVELS + 1]; // Logical blocks under an entry l levels above the data
+  uint64_t base[MAXLEVELS + 1]; // First logical block past the direct ones of each tree
+  uint64_t maxblks; // Logical blocks a file size can reach
+  uint isize;     // Bytes per dinode
+  uint ipb;       // Inodes per block
+  uint bpb;       // Bitmap bits per block
+  uint dpb;       // Directory entries per block
+  bool packed;    // Dinodes tile blocks exactly, so an inode's offset is a multiply
+} geo_t;
+
+struct geo_kern;
+
+// Superblock fields, whichever on-disk layout the image uses:
+//   the original {size, nblocks, ninodes, nlog}, inodes from block 2 then the bitmap;
+//   later xv6's, which puts the log first and adds logstart, inodestart and bmapstart;
+//   the same led by FSMAGIC, as written by the RISC-V port;
+//   the 64-bit address format's, whose fields are 64-bit words led by FSMAGIC64.
+// read_sb() fills in where the original layout keeps its inodes and bitmap.
+typedef struct {
+  uint asize;      // Bytes per block address the superblock's format uses
+  uint64_t size;
+  uint64_t nblocks;
+  uint64_t ninodes;
+  uint64_t nlog;
+  uint64_t logstart;   // Log header block, 0 if there is no log to replay
+  uint64_t inodestart;
+  uint64_t bmapstart;
+} sb_t;
+
+// Block replaced by the overlay: reads of blk are served from data, its copy in the log
+// or one staged by a repair
+typedef struct {
+  uint64_t blk;
+  char *data;
+} ovl_t;
+
+// Header of the undo journal a repair writes before changing the image. It is followed
+// by the numbers of the blocks the repair writes, in ascending order, then by what each
+// of them held before.
+typedef struct {
+  char magic[8]; // UNDO_MAGIC
+  uint64_t bsize;
+  uint64_t nblks;
+} undo_hdr_t;
+
+// Structure to hold image data. An img_t is only handed out by init_img() once the
+// superblock geometry has been proven to lie inside the mapped file, so the accessors
+// below do no bounds checks; inode numbers and block addresses read from the image are
+// validated where they enter (dirent inums in the walk, inode addresses in the scan).
 typedef struct {
+  geo_t geo;
+  const struct geo_kern *kern; // Kernels specialized for geo
   uint ninodeblks;
-  uint nbitmapblks;
-  uint firstblk;
-  struct superblock *sb;
+  uint64_t nbitmapblks;
+  uint64_t firstblk;
+  sb_t sb;
   char *inodeblks;
   char *bitmapblks;
   char *data;
   char *map;
+  off_t len;
+  ovl_t *ovl;      // Open-addressed table of blocks overlaid on the image
+  uint ovl_shift;  // 32 - log2 of its capacity
+  uint novl;       // Blocks in it, 0 when nothing is overlaid
+  uintptr_t pgmask; // Page size minus one
 } img_t;
 
+// Get the slot of the overlay where the search for a block starts
+uint ovl_slot(img_t *img, uint64_t addr) {
+  return (uint)((addr * 0x9E3779B97F4A7C15ULL) >> 32) >> img->ovl_shift;
+}
+
+// Find the overlaid contents of addr, or NULL if it reads from the image
+char *ovl_find(img_t *img, uint64_t addr) {
+  uint mask = ~0u >> img->ovl_shift;
+  for (uint h = ovl_slot(img, addr); img->ovl[h].blk != 0; h = (h + 1) & mask) {
+    if (img->ovl[h].blk == addr) return img->ovl[h].data;
+  }
+  return NULL;
+}
+
+// Get a pointer to a block of a validated image, as it reads after log recovery and
+// with any staged repair applied
+char *blk_ptr(img_t *img, uint64_t addr) {
+  if (img->novl) {
+    char *data = ovl_find(img, addr);
+    if (data) return data;
+  }
+  return img->map + ((size_t)addr << img->geo.bshift);
+}
+
+// Get a pointer to an inode of a validated image
+struct dinode *inode_ptr(img_t *img, uint inum) {
+  geo_t *g = &img->geo;
+  if (img->novl) {
+    return (struct dinode *)(blk_ptr(img, img->sb.inodestart + inum / g->ipb) +
+                             inum % g->ipb * g->isize);
+  }
+  if (g->packed) return (struct dinode *)(img->inodeblks + (size_t)inum * g->isize);
+  return (struct dinode *)(img->inodeblks + ((size_t)(inum / g->ipb) << g->bshift) +
+                           inum % g->ipb * g->isize);
+}
+
+// Get the addrs[] of an inode, which hold geo.ndirect + geo.nlevels slots of geo.asize
+// bytes whatever fs.h says
+void *inode_addrs(geo_t *g, struct dinode *in) {
+  return (char *)in + g->aoff;
+}
+
+// Get entry i of an array of block addresses in the image's format, such as addrs[] or
+// an indirect block
+uint64_t addr_at(geo_t *g, void *addrs, uint64_t i) {
+  return g->asize == 8 ? ((uint64_t *)addrs)[i] : ((uint *)addrs)[i];
+}
+
+// Set entry i of an array of block addresses in the image's format
+void set_addr(geo_t *g, void *addrs, uint64_t i, uint64_t addr) {
+  if (g->asize == 8) {
+    ((uint64_t *)addrs)[i] = addr;
+  } else {
+    ((uint *)addrs)[i] = addr;
+  }
+}
+
+// Get the size of an inode, a 64-bit word after the first four fields in the 64-bit
+// address format
+uint64_t inode_size(geo_t *g, struct dinode *in) {
+  if (g->asize == 4) return in->size;
+  uint64_t size;
+  memcpy(&size, (char *)in + 8, sizeof(size));
+  return size;
+}
+
+// Set the size of an inode, wherever its format keeps it
+void set_inode_size(geo_t *g, struct dinode *in, uint64_t size) {
+  if (g->asize == 4) {
+    in->size = size;
+  } else {
+    memcpy((char *)in + 8, &size, sizeof(size));
+  }
+}
+
+// Read the geo.nlevels indirect slots of an inode's addrs[] into slots
+void read_slots(geo_t *g, struct dinode *in, uint64_t *slots) {
+  void *addrs = inode_addrs(g, in);
+  for (uint k = 0; k < g->nlevels; k++) {
+    slots[k] = addr_at(g, addrs, g->ndirect + k);
+  }
+}
+
+// Entry of an inode's block map referencing a block, used to name the owners of
+// duplicated blocks: addrs[slot] itself at level 0, otherwise the entry at position pos
+// among those level levels below addrs[slot]
+typedef struct {
+  uint64_t blk;
+  uint inum;
+  uint slot;
+  uint level;
+  uint64_t pos;
+} owner_t;
+
+// Directory entry an inode was found through: containing directory and entry index
+typedef struct {
+  uint parent;
+  uint slot;
+} link_t;
+
+// Further entry for an inode that has several links
+typedef struct {
+  uint inum;
+  link_t at;
+} xlink_t;
+
+// Reference map and parent table built by the directory walk. Only the first entry
+// of each inode lives in links; hard links beyond it are kept in the extra list.
+typedef struct {
+  int *inmap;
+  link_t *links;
+  xlink_t *extra;
+  uint nextra, extracap;
+  uint *order;     // Inodes in the order the walk first found them, parents before children
+  uint norder;
+  uint badparent;  // First directory whose '..' does not name the directory it was found in
+  uint baddotdot;  // What that '..' named instead
+  uint dupdir;     // First directory holding two entries with the same name
+  uint dupslot;    // Index of the second of those entries
+} refs_t;
+
+// Slot of the name table: a directory entry's name, zero-padded
+typedef struct {
+  uint64_t lo, hi;
+  uint gen; // Directory that filled the slot; slots of older directories count as empty
+} name_slot_t;
+
+// Open-addressing table of the names in one directory, reused for every directory.
+// Bumping gen empties it without touching the slots, and only the first mask + 1 slots,
+// sized to the directory, are probed so small directories stay in cache.
+typedef struct {
+  name_slot_t *slots;
+  uint cap;  // Slots allocated
+  uint mask; // Slots used for the current directory, minus one
+  uint used;
+  uint gen;
+} names_t;
+
+// Derived data computed once and shared by every check that declares it needs it
+enum {
+  D_ALLOC    = 1 << 0, // Allocated inode numbers and the inode columns
+  D_DIRECT   = 1 << 1, // Direct addresses validated, and the logical blocks they cover
+  D_INDIRECT = 1 << 2, // Indirect addresses validated, and the logical blocks they cover
+  D_CLAIMED  = 1 << 3, // 2-bit usage counter of every block claimed by an inode
+  D_REFS     = 1 << 4, // Reference map and parent table from the directory walk
+};
+
+// Fields of every inode, one array per field indexed by inode number. Per-inode checks
+// sweep these dense arrays instead of striding over 64-byte dinodes to read a couple of
+// bytes from each, which lets the compiler vectorize them.
+typedef struct {
+  short *type;
+  short *nlink;
+  uint64_t *size;
+  uint64_t *indirect; // Indirect slots OR-ed: the indirect block when there is one slot
+} cols_t;
+
+// Shape statistics gathered for --report by the scan that validates block maps.
+// Histograms are indexed by bit length: bucket b counts values in [2^(b-1), 2^b), and
+// bucket 0 counts zeroes. A run is a stretch of a block list, taken in the order the
+// walk visits it (each indirect block just before its entries), whose blocks follow
+// each other on disk.
+typedef struct {
+  uint64_t runs;            // Runs of the inode being scanned so far
+  uint64_t prev;            // Last block of its block list so far
+  uint64_t files, bytes;
+  uint64_t sizes[65];       // File sizes
+  uint64_t nruns[65];       // Runs per file
+  uint64_t totruns, fragmented; // Runs of all files, and files of more than one run
+  uint worst;               // File of the most runs
+  uint64_t worstruns;
+  uint64_t ind[MAXLEVELS];  // Indirect blocks at each level below addrs[]
+  uint64_t indused[MAXLEVELS]; // Entries in them up to the last one in use
+} stats_t;
+
+// Lowest and highest block an inode claims, [0, 0] if none
+typedef struct {
+  uint64_t lo, hi;
+} span_t;
+
+// State shared by the checks of one run: the image and the derived data built so far
+typedef struct {
+  img_t *img;
+  uint *alloc;          // D_ALLOC, in ascending order
+  uint nalloc;
+  cols_t cols;          // D_ALLOC
+  uint *ndirect;        // D_DIRECT, one per allocated inode
+  uint64_t *nindirect;  // D_INDIRECT, one per allocated inode
+  uint64_t *claimed;    // D_CLAIMED
+  span_t *spans;        // D_CLAIMED, blocks each allocated inode claims lie within
+  const char *dup_type; // D_CLAIMED, kind of the first duplicate address met if any
+  refs_t refs;          // D_REFS
+  stats_t *stats;       // Gathered along with D_INDIRECT for --report, else NULL
+  bool all;             // Checks report every failure they find, not just the first
+} ctx_t;
+
+// Registry entry: a check and the tier it belongs to, along with the derived data it
+// consumes and produces. Producers of derived data are registered the same way. A check
+// that is only an estimate of what deeper tiers check exactly runs at its own tier alone.
+typedef struct {
+  const char *name;
+  int tier;
+  uint needs;
+  uint makes;
+  void (*run)(ctx_t *ctx);
+  bool only;
+} check_t;
+
+// A scheduled check: its captured error output and outcome
+typedef struct {
+  const check_t *chk;
+  ctx_t *ctx;
+  FILE *out;
+  char *buf;
+  size_t len;
+  bool ran;
+  bool failed;
+} task_t;
+
+__thread FILE *errf;       // Error output of the check running on this thread
+__thread task_t *cur_task; // Check running on this thread
+
+// Mark the running check as failed and stop it; the scheduler prints its output
+void fail(void) {
+  cur_task->failed = true;
+  pthread_exit(NULL);
+}
+
+// Directory block queued for the walk: its address and where it sits in its directory
+typedef struct {
+  uint64_t addr;
+  uint dinum;
+  uint lblk;
+} dblk_t;
+
 // Function to validate the type of an inode
-void validate_type(struct dinode *in) {
-  switch (in->type) {
+void validate_type(short type) {
+  switch (type) {
   case T_FILE:
   case T_DIR:
   case T_DEV:
     break;
   default:
-    fprintf(stderr, "ERROR: bad inode.\n");
-    exit(1);
+    fprintf(errf, "ERROR: bad inode.\n");
+    fail();
   }
 }
 
-// Function to check if an address is valid within the image
-bool valid_addr(img_t *img, uint addr) {
-  return addr > 0 && addr < img->sb->size;
+// Function to check if an address lies in the data region, past the metadata blocks
+bool valid_addr(img_t *img, uint64_t addr) {
+  return addr - img->firstblk < img->sb.size - img->firstblk;
 }
 
-// Function to check direct addresses in an inode
-void check_direct(img_t *img, struct dinode *in) {
-  for (int i = 0; i < NDIRECT; i++) {
-    uint addr = in->addrs[i];
-    if (addr == 0) continue;
-    if (!valid_addr(img, addr)) {
-      fprintf(stderr, "ERROR: bad direct address in inode.\n");
-      exit(1);
+// Check that a directory entry names an inode that exists
+void valid_inum(img_t *img, uint inum) {
+  if (inum >= img->sb.ninodes) {
+    fprintf(errf, "ERROR: directory entry refers to an inode out of range.\n");
+    fail();
+  }
+}
+
+// Kernel bodies below are inlined into one function per geometry, where their trip
+// counts become constants the compiler unrolls and vectorizes
+#define KERNEL static inline __attribute__((always_inline))
+
+// Load entry i of an array of block addresses w bytes wide. With w constant only one
+// of the loads is left.
+KERNEL uint64_t load_addr(void *addrs, uint64_t i, uint w) {
+  return w == 8 ? ((uint64_t *)addrs)[i] : ((uint *)addrs)[i];
+}
+
+// Count logical blocks up to the last non-zero address in a run of slots w bytes wide.
+// Written branch-free (a running max of slot numbers) so the compiler can vectorize it.
+KERNEL uint last_used(void *addrs, uint n, uint w) {
+  uint top = 0;
+  for (uint i = 0; i < n; i++) {
+    uint cand = (load_addr(addrs, i, w) != 0) * (i + 1);
+    top = cand > top ? cand : top;
+  }
+  return top;
+}
+
+// Mask of the first nslots slots of addrs[], w bytes wide, holding an address outside
+// the data region. Rebasing on firstblk turns the range test into one unsigned compare
+// per slot. 32-bit slots are compared VLANES at a time: the compare yields all-ones
+// lanes for bad slots, which select each slot's bit. Images in the 32-bit format have
+// fewer than 2^32 blocks, so their bounds fit the lanes.
+KERNEL uint bad_slots_n(img_t *img, void *addrs, uint nslots, uint w) {
+  if (w == 8) {
+    uint64_t lo = img->firstblk, span = img->sb.size - img->firstblk, *a = addrs;
+    uint mask = 0;
+    for (uint i = 0; i < nslots; i++) {
+      mask |= ((a[i] != 0) & (a[i] - lo >= span)) << i;
     }
+    return mask;
   }
+  uint lo = img->firstblk, span = img->sb.size - img->firstblk;
+  uint *a32 = addrs;
+  vuint acc = { 0 }, bit = { 1, 2, 4, 8 };
+  uint i = 0;
+  for (; i + VLANES <= nslots; i += VLANES, bit <<= VLANES) {
+    vuint a;
+    memcpy(&a, a32 + i, sizeof(a));
+    acc |= (vuint)(a != 0) & (vuint)(a - lo >= span) & bit;
+  }
+  uint mask = acc[0] | acc[1] | acc[2] | acc[3];
+  for (; i < nslots; i++) {
+    mask |= ((a32[i] != 0) & (a32[i] - lo >= span)) << i;
+  }
+  return mask;
 }
 
-// Function to check indirect addresses in an inode
-void check_indirect(img_t *img, struct dinode *in) {
-  uint addr = in->addrs[NDIRECT];
-  if (addr == 0) return;
-  if (!valid_addr(img, addr)) {
-    fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-    exit(1);
+// Check the n entries of an indirect block, w bytes wide, against the data region,
+// returning whether any is bad and setting nused to the logical blocks they cover
+KERNEL uint scan_indirect_n(img_t *img, void *ind, uint n, uint *nused, uint w) {
+  uint bad = 0;
+  if (w == 8) {
+    uint64_t lo = img->firstblk, span = img->sb.size - img->firstblk, *a = ind;
+    for (uint i = 0; i < n; i++) {
+      bad |= (a[i] != 0) & (a[i] - lo >= span);
+    }
+  } else {
+    uint lo = img->firstblk, span = img->sb.size - img->firstblk, *a = ind;
+    for (uint i = 0; i < n; i++) {
+      bad |= (a[i] != 0) & (a[i] - lo >= span);
+    }
+  }
+  *nused = last_used(ind, n, w);
+  return bad;
+}
+
+// Bump the 2-bit saturating usage counter of a block (00 unused, 01 once, 11 more
+// than once) and return 1 if the block was already used. Address 0 is left alone.
+KERNEL uint blk_usage_chk(uint64_t *usage_counts, uint64_t addr) {
+  uint64_t *w = usage_counts + addr / CNT_PER_WORD;
+  uint sh = (addr % CNT_PER_WORD) * 2;
+  uint64_t live = (addr != 0);
+  uint64_t seen = (*w >> sh) & 1;
+  *w |= ((seen << 1) | 1) * live << sh;
+  return seen & live;
+}
+
+// Widen the span [*lo, *hi] to take in the nonzero ones of n block addresses, w bytes
+// wide. An empty span is [0, 0]; subtracting one turns address 0 into the largest
+// value, so the minimum skips it without a branch.
+KERNEL void span_n(void *addrs, uint n, uint w, uint64_t *lo, uint64_t *hi) {
+  uint64_t l = *lo - 1, h = *hi;
+  for (uint i = 0; i < n; i++) {
+    uint64_t a = load_addr(addrs, i, w);
+    l = a - 1 < l ? a - 1 : l;
+    h = a > h ? a : h;
   }
+  *lo = l + 1;
+  *hi = h;
+}
 
-  uint indirect_addrs[NINDIRECT];
-  memcpy(indirect_addrs, img->map + addr * BLK_SZ, NINDIRECT * sizeof(uint));
+// Count n block addresses, w bytes wide, in the usage counters, returning whether any
+// was used before
+KERNEL uint claim_n(uint64_t *usage_counts, void *addrs, uint n, uint w) {
+  uint dup = 0;
+  for (uint i = 0; i < n; i++) {
+    dup |= blk_usage_chk(usage_counts, load_addr(addrs, i, w));
+  }
+  return dup;
+}
 
-  for (int i = 0; i < NINDIRECT; i++) {
-    addr = indirect_addrs[i];
-    if (addr == 0) continue;
-    if (!valid_addr(img, addr)) {
-      fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-      exit(1);
+// Kernels of one geometry, B bytes per block, N direct and L indirect slots and W bytes
+// per block address. Constant arguments give every loop a constant trip count; the
+// generic instance passes the image's own, which is why every kernel takes img.
+#define DEFINE_KERNELS(name, B, N, L, W)                                        \
+  uint bad_slots_##name(img_t *img, void *addrs) {                              \
+    return bad_slots_n(img, addrs, (N) + (L), (W));                             \
+  }                                                                             \
+  uint last_direct_##name(img_t *img, void *addrs) {                            \
+    (void)img;                                                                  \
+    return last_used(addrs, (N), (W));                                          \
+  }                                                                             \
+  uint scan_indirect_##name(img_t *img, void *ind, uint *nused) {               \
+    return scan_indirect_n(img, ind, (B) / (W), nused, (W));                    \
+  }                                                                             \
+  uint claim_direct_##name(img_t *img, uint64_t *usage_counts, void *addrs) {   \
+    (void)img;                                                                  \
+    return claim_n(usage_counts, addrs, (N), (W));                              \
+  }                                                                             \
+  uint claim_indirect_##name(img_t *img, uint64_t *usage_counts, void *ind) {   \
+    (void)img;                                                                  \
+    return claim_n(usage_counts, ind, (B) / (W), (W));                          \
+  }
+
+// Geometries with kernels specialized at compile time, as name, block size, direct and
+// indirect slots and address width. The one fs.h describes comes first and is the
+// default; the others are those of the xv6 forks we check, including the one that trades
+// a direct slot for a double-indirect one, and the 64-bit address format, whose 11
+// direct slots and three trees fill a 128-byte dinode. Images of any other geometry run
+// the generic kernels.
+#define GEOMETRIES(X)           \
+  X(fs, BSIZE, NDIRECT, 1, 4)   \
+  X(b512, 512, 12, 1, 4)        \
+  X(b1024, 1024, 12, 1, 4)      \
+  X(b2048, 2048, 12, 1, 4)      \
+  X(b4096, 4096, 12, 1, 4)      \
+  X(d512, 512, 11, 2, 4)        \
+  X(d1024, 1024, 11, 2, 4)      \
+  X(d4096, 4096, 11, 2, 4)      \
+  X(w4096, 4096, 11, 3, 8)
+
+GEOMETRIES(DEFINE_KERNELS)
+DEFINE_KERNELS(any, img->geo.bsize, img->geo.ndirect, img->geo.nlevels, img->geo.asize)
+
+// Kernels of a geometry, picked once per image by find_kern()
+typedef struct geo_kern {
+  uint bsize, ndirect, nlevels, asize; // 0 for the generic kernels
+  uint (*bad_slots)(img_t *img, void *addrs);
+  uint (*last_direct)(img_t *img, void *addrs);
+  uint (*scan_indirect)(img_t *img, void *ind, uint *nused);
+  uint (*claim_direct)(img_t *img, uint64_t *usage_counts, void *addrs);
+  uint (*claim_indirect)(img_t *img, uint64_t *usage_counts, void *ind);
+} geo_kern_t;
+
+#define KERNEL_ENTRY(name, B, N, L, W) \
+  { B, N, L, W, bad_slots_##name, last_direct_##name, scan_indirect_##name, \
+    claim_direct_##name, claim_indirect_##name },
+
+geo_kern_t geo_kerns[] = { GEOMETRIES(KERNEL_ENTRY) };
+geo_kern_t geo_kern_any = {
+  0, 0, 0, 0, bad_slots_any, last_direct_any, scan_indirect_any, claim_direct_any,
+  claim_indirect_any
+};
+
+#define NGEOS (sizeof(geo_kerns) / sizeof(geo_kerns[0]))
+
+// Find the kernels specialized for a geometry, or the generic ones
+const geo_kern_t *find_kern(geo_t *g) {
+  for (uint k = 0; k < NGEOS; k++) {
+    if (geo_kerns[k].bsize == g->bsize && geo_kerns[k].ndirect == g->ndirect &&
+        geo_kerns[k].nlevels == g->nlevels && geo_kerns[k].asize == g->asize) {
+      return &geo_kerns[k];
+    }
+  }
+  return &geo_kern_any;
+}
+
+// Print the name of an entry of an inode's block map: addrs[slot] itself at level 0, an
+// entry of the single indirect block as indirect[i], and an entry deeper in a tree as
+// the path of indices down from its slot
+void print_entry(img_t *img, uint slot, uint level, uint64_t pos) {
+  geo_t *g = &img->geo;
+  if (level > 0 && slot == g->ndirect) {
+    fprintf(errf, "indirect[%llu]", (unsigned long long)pos);
+    return;
+  }
+  fprintf(errf, "addrs[%u]", slot);
+  for (uint l = level; l-- > 0; ) {
+    fprintf(errf, "[%llu]", (unsigned long long)(pos / g->span[l] % g->nindirect));
+  }
+}
+
+// Print the slots of an inode's addrs[] set in a mask
+void print_slots(img_t *img, uint inum, void *addrs, uint mask) {
+  for (; mask != 0; mask &= mask - 1) {
+    int i = __builtin_ctz(mask);
+    fprintf(errf, "  inode %u: ", inum);
+    print_entry(img, i, 0, 0);
+    fprintf(errf, " = %llu\n", (unsigned long long)addr_at(&img->geo, addrs, i));
+  }
+}
+
+// Function to check the direct addresses of an inode, returning the number of logical
+// blocks they cover
+uint check_direct(img_t *img, uint inum, void *addrs) {
+  uint mask = img->kern->bad_slots(img, addrs) & DIRECT_SLOTS(img->geo.ndirect);
+  if (mask != 0) {
+    fprintf(errf, "ERROR: bad direct address in inode.\n");
+    print_slots(img, inum, addrs, mask);
+    fail();
+  }
+  return img->kern->last_direct(img, addrs);
+}
+
+// Check whether the entry at position pos, level levels below indirect slot slot,
+// starts at a logical block a file size can reach. Entries past that are never
+// descended into, which bounds the walk of a tree whose blocks point back at each other.
+bool map_reachable(geo_t *g, uint slot, uint level, uint64_t pos) {
+  uint k = slot - g->ndirect;
+  return g->ndirect + g->base[k] + pos * g->span[k + 1 - level] < g->maxblks;
+}
+
+// Prefetch an indirect block, so it is read while the one before it is decoded: from
+// the file ahead of the page fault if it is not resident, and into the cache if it is
+void prefetch_blk(img_t *img, uint64_t addr) {
+  char *p = blk_ptr(img, addr);
+  uintptr_t pg = (uintptr_t)p & ~img->pgmask;
+  madvise((void *)pg, (uintptr_t)p + img->geo.bsize - pg, MADV_WILLNEED);
+  for (uint off = 0; off < img->geo.bsize; off += 64) {
+    __builtin_prefetch(p + off);
+  }
+}
+
+// Get the histogram bucket of a value: its bit length
+uint bucket(uint64_t x) {
+  return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+// Extend the block list of the inode being scanned by a block, which starts a new run
+// unless it directly follows the last one
+void stats_step(stats_t *st, uint64_t addr) {
+  st->runs += addr != st->prev + 1;
+  st->prev = addr;
+}
+
+// Start the block list of an inode with its direct blocks
+void stats_start(stats_t *st, geo_t *g, void *addrs) {
+  st->runs = 0;
+  st->prev = ~0ULL;
+  for (uint s = 0; s < g->ndirect; s++) {
+    if (addr_at(g, addrs, s) != 0) stats_step(st, addr_at(g, addrs, s));
+  }
+}
+
+// Add the size and runs of a scanned file to the statistics
+void stats_file(stats_t *st, uint inum, uint64_t size) {
+  st->files++;
+  st->bytes += size;
+  st->sizes[bucket(size)]++;
+  st->nruns[bucket(st->runs)]++;
+  st->totruns += st->runs;
+  st->fragmented += st->runs > 1;
+  if (st->runs > st->worstruns) {
+    st->worst = inum;
+    st->worstruns = st->runs;
+  }
+}
+
+// Check the entries of one indirect block in the tree under addrs[slot]: those at
+// level levels below the slot, from position blkpos times the entries per block. Returns
+// the logical blocks the block covers up to the last one in use, or 0 if it or a block
+// below it has no entries. Blocks below are prefetched PF_AHEAD entries ahead of the
+// one being descended into. With st set, the block and its entries are added to the
+// statistics.
+uint64_t check_tblk(img_t *img, uint inum, uint slot, uint64_t addr, uint level,
+                    uint64_t blkpos, stats_t *st) {
+  geo_t *g = &img->geo;
+  void *ind = blk_ptr(img, addr);
+  uint nused;
+  if (img->kern->scan_indirect(img, ind, &nused)) {
+    fprintf(errf, "ERROR: bad indirect address in inode.\n");
+    for (uint i = 0; i < g->nindirect; i++) {
+      uint64_t a = addr_at(g, ind, i);
+      if (a != 0 && !valid_addr(img, a)) {
+        fprintf(errf, "  inode %u: ", inum);
+        print_entry(img, slot, level, blkpos * g->nindirect + i);
+        fprintf(errf, " = %llu\n", (unsigned long long)a);
+      }
+    }
+    fail();
+  }
+
+  uint depth = slot - g->ndirect + 1;
+  if (st) {
+    stats_step(st, addr);
+    st->ind[level - 1]++;
+    st->indused[level - 1] += nused;
+    for (uint i = 0; level == depth && i < nused; i++) {
+      if (addr_at(g, ind, i) != 0) stats_step(st, addr_at(g, ind, i));
+    }
+  }
+  if (level == depth) return nused;
+  uint64_t top = 0;
+  bool hollow = nused == 0;
+  for (uint i = 0; i < nused; i++) {
+    uint64_t pos = blkpos * g->nindirect + i, a = addr_at(g, ind, i);
+    if (i + PF_AHEAD < nused && addr_at(g, ind, i + PF_AHEAD) != 0) {
+      prefetch_blk(img, addr_at(g, ind, i + PF_AHEAD));
+    }
+    if (a == 0 || !map_reachable(g, slot, level, pos)) continue;
+    uint64_t n = check_tblk(img, inum, slot, a, level + 1, pos, st);
+    hollow |= n == 0;
+    top = i * g->span[depth - level] + n;
+  }
+  return hollow ? 0 : top;
+}
+
+// Function to check the trees of indirect blocks under an inode's indirect slots, the
+// geo.nlevels slots past the direct ones read into slots, returning the logical blocks
+// past the direct ones they cover up to the last one in use, or 0 if an indirect block
+// has no entries. With st set, the trees are added to the statistics.
+uint64_t check_indirect(img_t *img, uint inum, uint64_t *slots, stats_t *st) {
+  geo_t *g = &img->geo;
+  uint64_t top = 0;
+  bool hollow = false;
+  for (uint k = 0; k < g->nlevels; k++) {
+    if (slots[k] == 0) continue;
+    if (!valid_addr(img, slots[k])) {
+      fprintf(errf, "ERROR: bad indirect address in inode.\n");
+      fprintf(errf, "  inode %u: addrs[%d] = %llu\n", inum, g->ndirect + k,
+              (unsigned long long)slots[k]);
+      fail();
+    }
+    uint64_t n = check_tblk(img, inum, g->ndirect + k, slots[k], 1, 0, st);
+    hollow |= n == 0;
+    top = g->base[k] + n;
+  }
+  return hollow ? 0 : top;
+}
+
+// Visitor of an inode's block map, given an entry's address, its addrs[] slot, its level
+// below the slot (0 for the slot itself) and its position among the entries of that level
+typedef void (*map_fn)(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos);
+
+// Visit the non-zero entries of one indirect block of a validated tree, then of the
+// blocks below each of them, prefetching those PF_AHEAD entries ahead
+void walk_tblk(img_t *img, uint64_t addr, uint slot, uint level, uint64_t blkpos, map_fn fn,
+               void *arg) {
+  geo_t *g = &img->geo;
+  void *ind = blk_ptr(img, addr);
+  uint n = g->nindirect;
+  bool leaf = level == slot - g->ndirect + 1;
+  for (uint i = 0; i < n; i++) {
+    if (!leaf && i + PF_AHEAD < n && addr_at(g, ind, i + PF_AHEAD) != 0) {
+      prefetch_blk(img, addr_at(g, ind, i + PF_AHEAD));
     }
+    uint64_t a = addr_at(g, ind, i);
+    if (a == 0) continue;
+    uint64_t pos = blkpos * n + i;
+    fn(arg, a, slot, level, pos);
+    if (!leaf && map_reachable(g, slot, level, pos)) {
+      walk_tblk(img, a, slot, level + 1, pos, fn, arg);
+    }
+  }
+}
+
+// Visit every non-zero entry of an inode's validated block map: each addrs[] slot,
+// followed by the tree below it when it is an indirect slot
+void walk_map(img_t *img, void *addrs, map_fn fn, void *arg) {
+  geo_t *g = &img->geo;
+  for (uint s = 0; s < g->ndirect + g->nlevels; s++) {
+    uint64_t a = addr_at(g, addrs, s);
+    if (a == 0) continue;
+    fn(arg, a, s, 0, 0);
+    if (s >= g->ndirect) walk_tblk(img, a, s, 1, 0, fn, arg);
+  }
+}
+
+// Get the logical block of a file a block map entry holds, or -1 for an indirect block
+int64_t map_lblk(geo_t *g, uint slot, uint level, uint64_t pos) {
+  if (slot < g->ndirect) return slot;
+  uint k = slot - g->ndirect;
+  if (k >= MAXLEVELS || level != k + 1) return -1;
+  return g->ndirect + g->base[k] + pos;
+}
+
+// Get the block holding logical block lblk of a file with a validated block map, or 0
+uint64_t map_blk(img_t *img, void *addrs, uint64_t lblk) {
+  geo_t *g = &img->geo;
+  if (lblk < g->ndirect) return addr_at(g, addrs, lblk);
+  lblk -= g->ndirect;
+  uint k = 0;
+  while (k + 1 < g->nlevels && lblk >= g->base[k + 1]) k++;
+  lblk -= g->base[k];
+  uint64_t addr = addr_at(g, addrs, g->ndirect + k);
+  for (uint l = k + 1; l-- > 0 && addr != 0; ) {
+    addr = addr_at(g, blk_ptr(img, addr), lblk / g->span[l] % g->nindirect);
+  }
+  return addr;
+}
+
+// Count the blocks a file size spans, without overflowing on a 64-bit size
+uint64_t size_blks(geo_t *g, uint64_t size) {
+  return (size >> g->bshift) + ((size & (g->bsize - 1)) != 0);
+}
+
+// Function to check an inode's size against the blocks it has allocated, given the
+// logical blocks covered by its direct and indirect slots. Returns an error or NULL.
+const char *chk_size(img_t *img, short type, uint64_t size, bool has_ind, uint ndirect,
+                     uint64_t nindirect) {
+  if (type != T_FILE && type != T_DIR) return NULL;
+
+  // An indirect block without entries is allocated past EOF whatever the size says
+  geo_t *g = &img->geo;
+  uint64_t nblks = has_ind ? g->ndirect + nindirect : ndirect;
+  if (size_blks(g, size) != nblks || (has_ind && nindirect == 0)) {
+    return "ERROR: file size does not match allocated blocks.\n";
+  }
+  if (type == T_DIR && size % sizeof(struct dirent) != 0) {
+    return "ERROR: directory size is not a multiple of the directory entry size.\n";
   }
+  return NULL;
 }
 
 // Function to process directory entries, checking for '.' and '..'
-bool process_entries(img_t *img, uint addr, int inum, bool *dot, bool *ddot) {
-  struct dirent *de = (struct dirent *)(img->map + addr * BLK_SZ);
-  for (int j = 0; j < DPB; j++, de++) {
+bool process_entries(img_t *img, uint64_t addr, int inum, bool *dot, bool *ddot) {
+  struct dirent *de = (struct dirent *)blk_ptr(img, addr);
+  for (uint j = 0; j < img->geo.dpb; j++, de++) {
     if (strcmp(".", de->name) == 0) {
       *dot = true;
       if (de->inum != inum) {
-	fprintf(stderr, "ERROR: directory not properly formatted.\n");
-	exit(1);
+	fprintf(errf, "ERROR: directory not properly formatted.\n");
+	fail();
       }
     } else if (strcmp("..", de->name) == 0) {
       *ddot = true;
       if ((inum != 1 && de->inum == inum) || (inum == 1 && de->inum != inum)) {
-	fprintf(stderr, "ERROR: root directory does not exist.\n");
-	exit(1);
+	fprintf(errf, "ERROR: root directory does not exist.\n");
+	fail();
       }
     }
   }
@@ -108,371 +846,3357 @@ bool process_entries(img_t *img, uint addr, int inum, bool *dot, bool *ddot) {
 }
 
 // Function to validate a directory inode
-void validate_dir(img_t *img, struct dinode *in, int inum) {
+void validate_dir(img_t *img, void *addrs, int inum) {
   bool dot = false, ddot = false;
-  for (int i = 0; i < NDIRECT; i++) {
-    uint addr = in->addrs[i];
+  for (uint i = 0; i < img->geo.ndirect; i++) {
+    uint64_t addr = addr_at(&img->geo, addrs, i);
     if (addr == 0) continue;
     if (process_entries(img, addr, inum, &dot, &ddot)) break;
   }
   if (!dot || !ddot) {
-    fprintf(stderr, "ERROR: directory not properly formatted.\n");
-    exit(1);
+    fprintf(errf, "ERROR: directory not properly formatted.\n");
+    fail();
   }
 }
 
 // Function to check if an address is marked in the bitmap
-bool marked_in_bmp(char *bmp, uint addr) {
+bool marked_in_bmp(char *bmp, uint64_t addr) {
   return CHK_BIT(bmp, addr);
 }
 
-// Function to check indirect addresses and mark them as checked
-void chk_indirect(img_t *img, uint *ind, bool *chkd) {
-  for (int j = 0; j < NINDIRECT; j++, ind++) {
-    uint addr = *ind;
-    if (addr == 0 || chkd[addr]) continue;
-    if (!marked_in_bmp(img->bitmapblks, addr)) {
-      fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-      exit(1);
-    }
-    chkd[addr] = true;
-  }
+// Get a pointer to byte off of the bitmap, as it reads after log recovery. Words read
+// at aligned offsets never straddle two bitmap blocks.
+char *bmp_byte(img_t *img, uint64_t off) {
+  return blk_ptr(img, img->sb.bmapstart + (off >> img->geo.bshift)) + (off & (img->geo.bsize - 1));
 }
 
-// Function to check addresses in the bitmap for an inode
-void chk_bmp_addr(img_t *img, struct dinode *in) {
-  bool chkd[img->sb->size];
-  memset(chkd, 0, sizeof(chkd));
+// Pack a word of usage counters, which covers 32 blocks, down to the 32 bitmap bits of
+// those blocks: the low bit of each counter, set once a block is claimed
+uint32_t claimed_bits(uint64_t counters) {
+  uint64_t x = counters & ~CNT_DUP_MASK;
+  x = (x | (x >> 1)) & 0x3333333333333333ULL;
+  x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+  return (uint32_t)x;
+}
 
-  for (int i = 0; i <= NDIRECT; i++) {
-    uint addr = in->addrs[i];
-    if (addr == 0 || chkd[addr]) continue;
-    if (!marked_in_bmp(img->bitmapblks, addr)) {
-      fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-      exit(1);
-    }
-    chkd[addr] = true;
-    if (i == NDIRECT) {
-      uint *ind = (uint*)(img->map + addr * BLK_SZ);
-      chk_indirect(img, ind, chkd);
-    }
+// Find the first block claimed by an inode but free in the bitmap, or 0 if there is none.
+// The claimed bits of each word of counters are compared with the matching 32 bits of
+// the bitmap at once.
+uint64_t first_unmarked(img_t *img, uint64_t *claimed) {
+  uint64_t nwords = img->sb.size / CNT_PER_WORD + 1;
+  for (uint64_t i = 0; i < nwords; i++) {
+    if ((claimed[i] & ~CNT_DUP_MASK) == 0) continue;
+    uint32_t bm;
+    memcpy(&bm, bmp_byte(img, i * 4), sizeof(bm));
+    uint32_t unmarked = claimed_bits(claimed[i]) & ~bm;
+    if (unmarked) return i * CNT_PER_WORD + __builtin_ctz(unmarked);
   }
+  return 0;
 }
 
-// Mark a block as used in the used_blocks array
-void mark_used(int *used_blks, uint addr, uint startblk) {
+// Function to check that every address used by an inode is marked in the bitmap
+void chk_bmp_addr(ctx_t *ctx) {
+  uint64_t addr = first_unmarked(ctx->img, ctx->claimed);
   if (addr != 0) {
-    used_blks[addr - startblk] = 1;
+    fprintf(errf, "ERROR: address used by inode but marked free in bitmap.\n");
+    fprintf(errf, "  block %llu\n", (unsigned long long)addr);
+    fail();
   }
 }
 
-// Mark all blocks used by an inode
-void get_used(img_t *img, struct dinode *in, int *used_blks) {
-  // Mark all direct blocks
-  for (int i = 0; i < NDIRECT; i++) {
-    mark_used(used_blks, in->addrs[i], img->firstblk);
+// Find the first block marked in the bitmap but neither metadata nor claimed by an
+// inode, or 0 if there is none. Each 32 bits of the bitmap are compared with the claimed
+// bits of the matching word of counters at once.
+uint64_t first_unowned(img_t *img, uint64_t *claimed) {
+  uint64_t nwords = img->sb.size / CNT_PER_WORD + 1;
+  for (uint64_t i = img->firstblk / CNT_PER_WORD; i < nwords; i++) {
+    uint64_t blk = i * CNT_PER_WORD;
+    uint32_t bm;
+    memcpy(&bm, bmp_byte(img, i * 4), sizeof(bm));
+    if (blk < img->firstblk) bm &= ~0u << (img->firstblk - blk);
+    if (img->sb.size - blk < 32) bm &= (1u << (img->sb.size - blk)) - 1;
+    uint32_t unowned = bm & ~claimed_bits(claimed[i]);
+    if (unowned) return blk + __builtin_ctz(unowned);
   }
+  return 0;
+}
 
-  // Mark all indirect blocks
-  uint indaddr = in->addrs[NDIRECT];
-  if (indaddr != 0) {
-    uint *indirect = (uint *)(img->map + indaddr * BLK_SZ);
-    for (int j = 0; j < NINDIRECT; j++) {
-      mark_used(used_blks, indirect[j], img->firstblk);
-    }
+// Function to check that every block marked in the bitmap is metadata or used by an inode
+void bmp_chk(ctx_t *ctx) {
+  uint64_t addr = first_unowned(ctx->img, ctx->claimed);
+  if (addr != 0) {
+    fprintf(errf, "ERROR: bitmap marks block in use but it is not in use.\n");
+    fprintf(errf, "  block %llu\n", (unsigned long long)addr);
+    fail();
   }
 }
 
-// Mark all blocks used by all inodes
-void mark_used_blks(img_t *img, int *used_blks) {
-  struct dinode *in = (struct dinode*)(img->inodeblks);
-  for (int i = 0; i < img->sb->ninodes; i++, in++) {
-    if (in->type != 0) {
-      get_used(img, in, used_blks);
-    }
+// Check whether the usage counter of a block saturated
+bool blk_is_dup(uint64_t *usage_counts, uint64_t addr) {
+  return (usage_counts[addr / CNT_PER_WORD] >> ((addr % CNT_PER_WORD) * 2 + 1)) & 1;
+}
+
+// Owners found by find_owners(), and the duplicated blocks it looks for
+typedef struct {
+  uint64_t *usage_counts;
+  uint inum;
+  owner_t *owners;
+  uint nowners, cap;
+} owners_t;
+
+// Record the owner of a block if it is one of the duplicated blocks
+void note_owner(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  owners_t *o = arg;
+  if (!blk_is_dup(o->usage_counts, addr)) return;
+  if (o->nowners == o->cap) {
+    o->cap = o->cap ? o->cap * 2 : 16;
+    o->owners = realloc(o->owners, o->cap * sizeof(owner_t));
   }
+  o->owners[o->nowners++] = (owner_t){ addr, o->inum, slot, level, pos };
 }
 
-// Check if block is marked in bitmap and update check list
-void chk_mark_bmp(char *bmp, uint addr, bool *chklist) {
-  if (!CHK_BIT(bmp, addr)) {
-    fprintf(stderr, "ERROR: bitmap marks block in use but it is not in use.\n");
-    exit(1);
+// Second pass over the inodes, run only once duplicates are known, that names every
+// inode and block map entry referencing a duplicated block. Only the inodes whose span
+// of claimed blocks holds one of the ndups duplicated blocks, listed in ascending order,
+// have their block maps walked.
+owner_t *find_owners(ctx_t *ctx, uint64_t *dups, uint64_t ndups, uint *nowners) {
+  img_t *img = ctx->img;
+  owners_t o = { ctx->claimed, 0, NULL, 0, 0 };
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    // First duplicated block at or after the start of the span
+    span_t *sp = &ctx->spans[k];
+    uint64_t lo = 0, hi = ndups;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (dups[mid] < sp->lo) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == ndups || dups[lo] > sp->hi) continue;
+    o.inum = ctx->alloc[k];
+    walk_map(img, inode_addrs(&img->geo, inode_ptr(img, o.inum)), note_owner, &o);
   }
-  chklist[addr] = true;
+  *nowners = o.nowners;
+  return o.owners;
 }
 
-// Verify bitmap consistency with inode addresses
-void bmp_chk(img_t *img) {
-  bool chklist[img->sb->size];
-  memset(chklist, 0, sizeof(chklist));
+// Order owners by block, then inode, then place in the block map
+int cmp_owner(const void *a, const void *b) {
+  const owner_t *x = a, *y = b;
+  if (x->blk != y->blk) return x->blk < y->blk ? -1 : 1;
+  if (x->inum != y->inum) return x->inum < y->inum ? -1 : 1;
+  if (x->slot != y->slot) return x->slot < y->slot ? -1 : 1;
+  if (x->level != y->level) return x->level < y->level ? -1 : 1;
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
 
-  struct dinode *in = (struct dinode*)(img->inodeblks);
-  for (int i = 0; i < img->sb->ninodes; i++, in++) {
-    if (in->type == 0) continue;
+// Report every block whose usage counter saturated, along with all of its owners
+void report_dups(ctx_t *ctx, const char *type) {
+  img_t *img = ctx->img;
+  fprintf(errf, "ERROR: %s address used more than once.\n", type);
 
-    // Check direct addresses
-    for (int j = 0; j < NDIRECT; j++) {
-      if (in->addrs[j] != 0) {
-        chk_mark_bmp(img->bitmapblks, in->addrs[j], chklist);
+  // List the duplicated blocks so the owner pass can tell which inodes may hold them
+  uint64_t nwords = img->sb.size / CNT_PER_WORD + 1, ndups = 0, cap = 16;
+  uint64_t *dups = malloc(cap * sizeof(uint64_t));
+  for (uint64_t i = 0; i < nwords; i++) {
+    for (uint64_t d = ctx->claimed[i] & CNT_DUP_MASK; d != 0; d &= d - 1) {
+      if (ndups == cap) {
+        cap *= 2;
+        dups = realloc(dups, cap * sizeof(uint64_t));
       }
+      dups[ndups++] = i * CNT_PER_WORD + __builtin_ctzll(d) / 2;
     }
+  }
 
-    // Check indirect addresses
-    uint indaddr = in->addrs[NDIRECT];
-    if (indaddr != 0) {
-      uint *indirect = (uint *)(img->map + indaddr * BLK_SZ);
-      for (int j = 0; j < NINDIRECT; j++) {
-        if (indirect[j] != 0) {
-          chk_mark_bmp(img->bitmapblks, indirect[j], chklist);
-        }
-      }
+  uint nowners;
+  owner_t *owners = find_owners(ctx, dups, ndups, &nowners);
+  free(dups);
+  qsort(owners, nowners, sizeof(owner_t), cmp_owner);
+  for (uint k = 0; k < nowners; k++) {
+    bool same = k > 0 && owners[k].blk == owners[k - 1].blk;
+    if (!same) {
+      fprintf(errf, "%s  block %llu:", k == 0 ? "" : "\n", (unsigned long long)owners[k].blk);
     }
+    fprintf(errf, "%s inode %u ", same ? "," : "", owners[k].inum);
+    print_entry(img, owners[k].slot, owners[k].level, owners[k].pos);
   }
+  if (nowners) fprintf(errf, "\n");
+  free(owners);
+}
 
-  // Final check for unused blocks marked as used
-  for (uint i = 0; i < img->sb->size; i++) {
-    if (CHK_BIT(img->bitmapblks, i) && !chklist[i]) {
-      // Error handling
+// Count the entries of one indirect block of a validated tree in the usage counters,
+// then those of the blocks below it, returning whether any was used before. Widens the
+// span of the inode's claimed blocks to take them in.
+uint claim_tblk(img_t *img, uint64_t *usage_counts, uint64_t addr, uint slot, uint level,
+                uint64_t blkpos, span_t *sp) {
+  geo_t *g = &img->geo;
+  void *ind = blk_ptr(img, addr);
+  uint n = g->nindirect;
+  uint dup = img->kern->claim_indirect(img, usage_counts, ind);
+  span_n(ind, n, g->asize, &sp->lo, &sp->hi);
+  if (level == slot - g->ndirect + 1) return dup;
+  for (uint i = 0; i < n; i++) {
+    uint64_t pos = blkpos * n + i, a = addr_at(g, ind, i);
+    if (i + PF_AHEAD < n && addr_at(g, ind, i + PF_AHEAD) != 0) {
+      prefetch_blk(img, addr_at(g, ind, i + PF_AHEAD));
     }
+    if (a == 0 || !map_reachable(g, slot, level, pos)) continue;
+    dup |= claim_tblk(img, usage_counts, a, slot, level + 1, pos, sp);
   }
+  return dup;
 }
 
-// Count the usage of direct block addresses
-void fill_direct(img_t *img, struct dinode *in, uint *dcounts) {
-  for (int i = 0; i < NDIRECT; i++) {
-    uint addr = in->addrs[i];
-    if (addr == 0) continue;
-    if (addr < img->firstblk || addr >= img->sb->size) {
-      fprintf(stderr, "ERROR: direct block address out of bounds.\n");
-      exit(1);
+// Count every block claimed by an allocated inode: direct blocks, the indirect blocks
+// and the blocks they list. Remembers the kind of the first duplicate address met, and
+// the span of each inode's claimed blocks for naming the owners of duplicates.
+void run_claimed(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  geo_t *g = &img->geo;
+  uint64_t *usage_counts = calloc(img->sb.size / CNT_PER_WORD + 1, sizeof(uint64_t));
+  span_t *spans = calloc(ctx->nalloc, sizeof(span_t));
+
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    void *addrs = inode_addrs(g, inode_ptr(img, ctx->alloc[k]));
+
+    // Count direct block addresses, and take every slot into the span
+    uint dup = img->kern->claim_direct(img, usage_counts, addrs);
+    if (dup && !ctx->dup_type) ctx->dup_type = "direct";
+    span_n(addrs, g->ndirect + g->nlevels, g->asize, &spans[k].lo, &spans[k].hi);
+
+    // Count the indirect blocks and the addresses they hold
+    for (uint s = g->ndirect; s < g->ndirect + g->nlevels; s++) {
+      uint64_t a = addr_at(g, addrs, s);
+      if (a == 0) continue;
+      dup = blk_usage_chk(usage_counts, a);
+      dup |= claim_tblk(img, usage_counts, a, s, 1, 0, &spans[k]);
+      if (dup && !ctx->dup_type) ctx->dup_type = "indirect";
     }
-    dcounts[addr - img->firstblk]++;
   }
+  ctx->claimed = usage_counts;
+  ctx->spans = spans;
 }
 
-// Count the usage of indirect block addresses
-void fill_indirect(img_t *img, struct dinode *in, uint *icounts) {
-  uint indaddr = in->addrs[NDIRECT];
-  if (indaddr == 0) return;
-  if (indaddr < img->firstblk || indaddr >= img->sb->size) {
-    fprintf(stderr, "ERROR: indirect block address out of bounds.\n");
-    exit(1);
+// Validate inode addresses for proper usage
+void addrs_chk(ctx_t *ctx) {
+  // Duplicates are reported together once every inode has been counted
+  if (ctx->dup_type) {
+    report_dups(ctx, ctx->dup_type);
+    fail();
   }
+}
 
-  uint *indirect = (uint *)(img->map + indaddr * BLK_SZ);
-  for (int i = 0; i < NINDIRECT; i++, indirect++) {
-    uint addr = *indirect;
-    if (addr == 0) continue;
-    if (addr < img->firstblk || addr >= img->sb->size) {
-      fprintf(stderr, "ERROR: indirect block address out of bounds.\n");
-      exit(1);
-    }
-    icounts[addr - img->firstblk]++;
+// Record a directory entry referring to inum, keeping the first one in the parent table
+void add_ref(refs_t *refs, uint inum, uint parent, uint slot) {
+  if (refs->inmap[inum]++ == 0) {
+    refs->links[inum] = (link_t){ parent, slot };
+    return;
   }
+  if (refs->nextra == refs->extracap) {
+    refs->extracap = refs->extracap ? refs->extracap * 2 : 16;
+    refs->extra = realloc(refs->extra, refs->extracap * sizeof(xlink_t));
+  }
+  refs->extra[refs->nextra++] = (xlink_t){ inum, { parent, slot } };
 }
 
-// Check the usage of block addresses for duplicates
-void blk_usage_chk(img_t *img, uint *usage_counts, uint startblk, const char* type, uint addr) {
-  if (addr == 0) return;
-  uint idx = addr - startblk;
-  usage_counts[idx]++;
-  if (usage_counts[idx] > 1) {
-    fprintf(stderr, "ERROR: %s address used more than once.\n", type);
-    exit(1);
+// Compare a directory's '..' entry with the directory the walk found it in
+void chk_parent(refs_t *refs, uint dinum, uint dotdot) {
+  uint parent = dinum == ROOTINO ? ROOTINO : refs->links[dinum].parent;
+  if (dotdot != parent && refs->badparent == 0) {
+    refs->badparent = dinum;
+    refs->baddotdot = dotdot;
   }
 }
 
-// Validate inode addresses for proper usage
-void addrs_chk(img_t *img) {
-  uint usage_counts[img->sb->nblocks];
-  memset(usage_counts, 0, sizeof(usage_counts));
+// Hash a zero-padded name
+uint64_t name_hash(uint64_t lo, uint64_t hi) {
+  uint64_t h = (lo ^ (hi * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 32);
+}
 
-  struct dinode *in = (struct dinode*)(img->inodeblks);
-  for (int i = 0; i < img->sb->ninodes; i++, in++) {
-    if (in->type == 0) continue;
+// Place a name in the table without looking for duplicates
+void names_place(names_t *t, uint64_t lo, uint64_t hi) {
+  uint i = name_hash(lo, hi) & t->mask;
+  while (t->slots[i].gen == t->gen) i = (i + 1) & t->mask;
+  t->slots[i] = (name_slot_t){ lo, hi, t->gen };
+}
 
-    // Check direct block addresses
-    for (int j = 0; j < NDIRECT; j++) {
-      blk_usage_chk(img, usage_counts, img->firstblk, "direct", in->addrs[j]);
-    }
+// Empty the table for a directory expected to hold about n names
+void names_reset(names_t *t, uint n) {
+  uint size = 16;
+  while (size < 2 * n) size *= 2;
+  if (size > t->cap) {
+    free(t->slots);
+    t->slots = calloc(size, sizeof(name_slot_t));
+    t->cap = size;
+  }
+  t->mask = size - 1;
+  t->used = 0;
+  t->gen++;
+}
 
-    // Check indirect block addresses
-    uint indaddr = in->addrs[NDIRECT];
-    if (indaddr != 0) {
-      uint *indirect = (uint *)(img->map + indaddr * BLK_SZ);
-      for (int j = 0; j < NINDIRECT; j++) {
-        blk_usage_chk(img, usage_counts, img->firstblk, "indirect", indirect[j]);
-      }
-    }
+// Double the slots in use, keeping the names of the current directory
+void names_grow(names_t *t) {
+  uint n = t->used;
+  name_slot_t *keep = malloc(n * sizeof(name_slot_t));
+  for (uint i = 0, k = 0; i <= t->mask; i++) {
+    if (t->slots[i].gen == t->gen) keep[k++] = t->slots[i];
+  }
+  names_reset(t, 2 * n);
+  for (uint k = 0; k < n; k++) {
+    names_place(t, keep[k].lo, keep[k].hi);
   }
+  t->used = n;
+  free(keep);
 }
 
-// Traverse directories and increment inode map for each entry
-void traverse_dirs(img_t *img, struct dinode *dir_inode, int *inodemap) {
-    if (dir_inode->type != T_DIR) {
-        // Exit if not a directory
-        return;
-    }
+// Flag the zero bytes of a word (exact up to and including the first one)
+uint64_t zero_bytes(uint64_t x) {
+  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
 
-    // Helper function to process a block of directory entries
-    void process_block(uint addr) {
-        if (addr == 0) return;
+// Add a directory entry's name to the table, returning true if the directory already
+// holds an entry with that name. The entry is loaded as two fixed-width words with its
+// inum and everything past the name's NUL masked off, so names compare like xv6's
+// namecmp (up to DIRSIZ bytes) without a byte loop.
+bool names_add(names_t *t, struct dirent *de) {
+  uint64_t lo, hi;
+  memcpy(&lo, de, sizeof(lo));
+  memcpy(&hi, (char *)de + sizeof(lo), sizeof(hi));
 
-        struct dirent *de = (struct dirent *)(img->map + addr * BLK_SZ);
-        for (int j = 0; j < DPB; j++, de++) {
-            if (de->inum == 0 || strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) continue;
+  uint64_t z = zero_bytes(lo | 0xFFFF);
+  if (z) {
+    lo &= (1ULL << (__builtin_ctzll(z) + 1 - 8)) - 1;
+    hi = 0;
+  } else if ((z = zero_bytes(hi)) != 0) {
+    hi &= (1ULL << (__builtin_ctzll(z) + 1 - 8)) - 1;
+  }
+  lo &= ~0xFFFFULL;
 
-            inodemap[de->inum]++;
-            struct dinode *next_inode = ((struct dinode *)(img->inodeblks)) + de->inum;
-            traverse_dirs(img, next_inode, inodemap);
-        }
-    }
+  uint i = name_hash(lo, hi) & t->mask;
+  for (; t->slots[i].gen == t->gen; i = (i + 1) & t->mask) {
+    if (t->slots[i].lo == lo && t->slots[i].hi == hi) return true;
+  }
+  t->slots[i] = (name_slot_t){ lo, hi, t->gen };
+  if (++t->used * 2 > t->mask + 1) names_grow(t);
+  return false;
+}
 
-    // Process direct addresses
-    for (int i = 0; i < NDIRECT; i++) {
-        process_block(dir_inode->addrs[i]);
+// Order directory blocks by directory, then by position in it
+int cmp_dblk_dir(const void *a, const void *b) {
+  const dblk_t *x = a, *y = b;
+  if (x->dinum != y->dinum) return x->dinum < y->dinum ? -1 : 1;
+  return x->lblk < y->lblk ? -1 : x->lblk > y->lblk;
+}
+
+// Check that no directory of a round holds two entries with the same name. It runs
+// right after the round's sweep, while its blocks are still cached, taking them one
+// directory at a time with a table sized to that directory.
+void chk_names(img_t *img, dblk_t *blks, uint nblks, refs_t *refs, names_t *names) {
+  uint dpb = img->geo.dpb;
+  qsort(blks, nblks, sizeof(dblk_t), cmp_dblk_dir);
+  for (uint k = 0; k < nblks; k++) {
+    if (k == 0 || blks[k].dinum != blks[k - 1].dinum) {
+      uint g = k;
+      while (g < nblks && blks[g].dinum == blks[k].dinum) g++;
+      uint64_t n = inode_size(&img->geo, inode_ptr(img, blks[k].dinum)) / sizeof(struct dirent);
+      names_reset(names, n < (uint64_t)(g - k) * dpb ? n : (g - k) * dpb);
     }
 
-    // Process indirect addresses
-    uint addr = dir_inode->addrs[NDIRECT];
-    if (addr != 0) {
-        uint *indirect = (uint *)(img->map + addr * BLK_SZ);
-        for (int i = 0; i < NINDIRECT; i++, indirect++) {
-            process_block(*indirect);
-        }
+    struct dirent *de = (struct dirent *)blk_ptr(img, blks[k].addr);
+    for (uint j = 0; j < dpb; j++, de++) {
+      if (de->inum != 0 && names_add(names, de) && refs->dupdir == 0) {
+        refs->dupdir = blks[k].dinum;
+        refs->dupslot = blks[k].lblk * dpb + j;
+      }
     }
+  }
 }
 
-// Check if an inode marked as used is actually in use
-void chk_in_use(struct dinode *in, int idx, int *inmap) {
-  if (in->type != 0 && inmap[idx] == 0) {
-    fprintf(stderr, "ERROR: inode marked use but not found in a directory.\n");
-    exit(1);
+// Queue a directory block for the next sweep
+void queue_blk(dblk_t **blks, uint *nblks, uint *cap, uint64_t addr, uint dinum, uint lblk) {
+  if (addr == 0) return;
+  if (*nblks == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *blks = realloc(*blks, *cap * sizeof(dblk_t));
   }
+  (*blks)[(*nblks)++] = (dblk_t){ addr, dinum, lblk };
 }
 
-// Check if an inode referred to in a directory is marked as free
-void chk_in_free(struct dinode *in, int idx, int *inmap) {
-  if (inmap[idx] > 0 && in->type == 0) {
-    fprintf(stderr, "ERROR: inode referred to in directory but marked free.\n");
-    exit(1);
-  }
+// Directory blocks queued for a sweep, and the directory being queued
+typedef struct {
+  img_t *img;
+  dblk_t *blks;
+  uint nblks, cap;
+  uint dinum;
+} dqueue_t;
+
+// Queue a data block of a directory. Blocks past what a 32-bit size can reach are left
+// for chk_size to report.
+void queue_dir_blk(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  dqueue_t *q = arg;
+  int64_t lblk = map_lblk(&q->img->geo, slot, level, pos);
+  if (lblk < 0 || lblk >= (int64_t)((1ULL << 32) >> q->img->geo.bshift)) return;
+  queue_blk(&q->blks, &q->nblks, &q->cap, addr, q->dinum, lblk);
 }
 
-// Check if the reference count of a file inode matches the directory entries
-void chk_ref_cnt(struct dinode *in, int idx, int *inmap) {
-  if (in->type == T_FILE && in->nlink != inmap[idx]) {
-    fprintf(stderr, "ERROR: bad reference count for file.\n");
-    exit(1);
+// Order directory blocks by address
+int cmp_dblk(const void *a, const void *b) {
+  const dblk_t *x = a, *y = b;
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// Order inode numbers
+int cmp_uint(const void *a, const void *b) {
+  uint x = *(const uint *)a, y = *(const uint *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Process a queued block of directory entries, adding every inode found for the first
+// time to the next frontier
+void traverse_block(img_t *img, dblk_t *blk, refs_t *refs, uint **next, uint *nnext,
+                    uint *cap) {
+  struct dirent *de = (struct dirent *)blk_ptr(img, blk->addr);
+  for (uint j = 0; j < img->geo.dpb; j++, de++) {
+    if (de->inum == 0 || strcmp(de->name, ".") == 0) continue;
+    if (strcmp(de->name, "..") == 0) {
+      chk_parent(refs, blk->dinum, de->inum);
+      continue;
+    }
+
+    // Only expand the first time an inode is found, so cycles terminate
+    valid_inum(img, de->inum);
+    bool first = refs->inmap[de->inum] == 0;
+    add_ref(refs, de->inum, blk->dinum, blk->lblk * img->geo.dpb + j);
+    if (first) {
+      refs->order[refs->norder++] = de->inum;
+      if (*nnext == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *next = realloc(*next, *cap * sizeof(uint));
+      }
+      (*next)[(*nnext)++] = de->inum;
+    }
   }
 }
 
-// Ensure a directory inode is only referenced once
-void chk_dir_once(struct dinode *in, int idx, int *inmap) {
-  if (in->type == T_DIR && inmap[idx] > 1) {
-    fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-    exit(1);
+// Traverse directories level by level from dinum and record every entry in the
+// reference map. Each level visits the inode table in ascending inode order to find
+// the frontier's directories, then reads all of their blocks in ascending block order,
+// so both the inode table and the data region are swept forward instead of hit at
+// random in dirent order. Names are then checked for uniqueness per directory.
+void traverse_dirs(img_t *img, uint dinum, refs_t *refs) {
+  uint *frontier = malloc(sizeof(uint)), nfrontier = 1, fcap = 1;
+  uint *next = NULL, nnext = 0, ncap = 0;
+  dqueue_t q = { img, NULL, 0, 0, 0 };
+  names_t names = { 0 };
+  frontier[0] = dinum;
+
+  while (nfrontier > 0) {
+    qsort(frontier, nfrontier, sizeof(uint), cmp_uint);
+
+    // Collect the blocks of the frontier's directories
+    q.nblks = 0;
+    for (uint k = 0; k < nfrontier; k++) {
+      struct dinode *dir_inode = inode_ptr(img, frontier[k]);
+      if (dir_inode->type != T_DIR) continue;
+      q.dinum = frontier[k];
+      walk_map(img, inode_addrs(&img->geo, dir_inode), queue_dir_blk, &q);
+    }
+
+    // Sweep them in block order, gathering the next frontier
+    qsort(q.blks, q.nblks, sizeof(dblk_t), cmp_dblk);
+    nnext = 0;
+    for (uint k = 0; k < q.nblks; k++) {
+      traverse_block(img, &q.blks[k], refs, &next, &nnext, &ncap);
+    }
+    chk_names(img, q.blks, q.nblks, refs, &names);
+
+    // The next frontier becomes the current one; the old buffer is reused
+    uint *tmp = frontier;
+    uint tmpcap = fcap;
+    frontier = next;
+    fcap = ncap;
+    next = tmp;
+    ncap = tmpcap;
+    nfrontier = nnext;
   }
+
+  free(frontier);
+  free(next);
+  free(q.blks);
+  free(names.slots);
 }
 
-// Main function to perform directory checks
-void dir_chk(img_t *img) {
-  int inmap[img->sb->ninodes];
-  memset(inmap, 0, sizeof(int) * img->sb->ninodes);
-  struct dinode *in, *root;
-
-  // Initialize and traverse the directory structure
-  in = (struct dinode *)(img->inodeblks);
-  root = ++in;
-  inmap[0]++;
-  inmap[1]++;
-  traverse_dirs(img, root, inmap);
-  in++;
-  for (int i = 2; i < img->sb->ninodes; i++, in++) {
-    chk_in_use(in, i, inmap);
-    chk_in_free(in, i, inmap);
-    chk_ref_cnt(in, i, inmap);
-    chk_dir_once(in, i, inmap);
-  }
-}
-
-// Initialize the image structure with mmap and other details
-void init_img(img_t *img, char *mmap, char *fname) {
-  img->map = mmap;
-  img->sb = (struct superblock *)(mmap + 1 * BLK_SZ);
-  img->ninodeblks = (img->sb->ninodes / IPB) + 1;
-  img->nbitmapblks = (img->sb->size / BPB) + 1;
-  img->inodeblks = (char *)(mmap + 2 * BLK_SZ);
-  img->bitmapblks = (char *)(img->inodeblks + img->ninodeblks * BLK_SZ);
-  img->data = (char *)(img->bitmapblks + img->nbitmapblks * BLK_SZ);
-  img->firstblk = img->ninodeblks + img->nbitmapblks + 2;
+// Find the entry a link points at, by mapping its slot back to a directory block
+struct dirent *link_dirent(img_t *img, link_t *l) {
+  void *addrs = inode_addrs(&img->geo, inode_ptr(img, l->parent));
+  uint64_t addr = map_blk(img, addrs, l->slot / img->geo.dpb);
+  return (struct dirent *)blk_ptr(img, addr) + l->slot % img->geo.dpb;
 }
 
-// Main function to load and check the file system image
-int main(int argc, char *argv[]) {
-  int fsfd;
-  img_t img;
-  char *mmap_img;
-  struct stat fsStat;
+// Write the absolute path leading through a link, materializing names from the image
+void put_path(FILE *f, img_t *img, refs_t *refs, link_t *l) {
+  link_t **chain = malloc(img->sb.ninodes * sizeof(link_t *));
+  uint depth = 0;
 
-  // Basic argument check
-  if (argc < 2) {
-    fprintf(stderr, "Usage: fcheck <file_system_image>\n");
-    exit(1);
+  // Walk up the first links to the root; a bounded walk also stops on parent loops
+  chain[depth++] = l;
+  while (chain[depth - 1]->parent != ROOTINO && depth < img->sb.ninodes) {
+    chain[depth] = &refs->links[chain[depth - 1]->parent];
+    depth++;
   }
 
-  // Open file system image
-  fsfd = open(argv[1], O_RDONLY);
-  if (fsfd < 0) {
-    perror(argv[1]);
-    exit(1);
+  while (depth-- > 0) {
+    fprintf(f, "/%.*s", DIRSIZ, link_dirent(img, chain[depth])->name);
+  }
+  free(chain);
+}
+
+// Print the absolute path leading through a link
+void print_path(img_t *img, refs_t *refs, link_t *l) {
+  fprintf(errf, "  path: ");
+  put_path(errf, img, refs, l);
+  fprintf(errf, "\n");
+}
+
+// Print every path an inode is reachable through
+void print_paths(img_t *img, refs_t *refs, uint inum) {
+  if (inum == ROOTINO) {
+    fprintf(errf, "  path: /\n");
+    return;
+  }
+  if (refs->inmap[inum] == 0) return;
+  print_path(img, refs, &refs->links[inum]);
+  for (uint k = 0; k < refs->nextra; k++) {
+    if (refs->extra[k].inum == inum) {
+      print_path(img, refs, &refs->extra[k].at);
+    }
+  }
+}
+
+// Find the representative of an inode's orphan group, compressing the path to it
+uint uf_find(uint *uf, uint x) {
+  uint root = x;
+  while (uf[root] != root) root = uf[root];
+  while (uf[x] != root) {
+    uint next = uf[x];
+    uf[x] = root;
+    x = next;
+  }
+  return root;
+}
+
+// Merge the orphan groups of two inodes, keeping the larger group's representative
+void uf_union(uint *uf, uint *members, uint a, uint b) {
+  a = uf_find(uf, a);
+  b = uf_find(uf, b);
+  if (a == b) return;
+  if (members[a] < members[b]) {
+    uint t = a;
+    a = b;
+    b = t;
+  }
+  uf[b] = a;
+  members[a] += members[b];
+}
+
+// Check whether an inode is allocated but was not reached by the directory walk
+bool is_orphan(img_t *img, refs_t *refs, uint inum) {
+  return inum >= 2 && inum < img->sb.ninodes && inode_ptr(img, inum)->type != 0 &&
+         refs->inmap[inum] == 0;
+}
+
+// Count one block of an inode's block map
+void count_blk(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  (void)addr;
+  (void)slot;
+  (void)level;
+  (void)pos;
+  (*(uint64_t *)arg)++;
+}
+
+// Count the blocks an inode holds, its indirect blocks included
+uint64_t inode_blks(img_t *img, struct dinode *in) {
+  uint64_t n = 0;
+  walk_map(img, inode_addrs(&img->geo, in), count_blk, &n);
+  return n;
+}
+
+// Orphan groups being built by orphan_groups(), and the directory being joined
+typedef struct {
+  img_t *img;
+  refs_t *refs;
+  uint *uf;
+  uint *members;
+  bool *child;
+  uint dinum;
+} orphan_uf_t;
+
+// Join an orphan directory with the orphans its entries in one data block refer to
+void union_orphan_blk(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  orphan_uf_t *o = arg;
+  if (map_lblk(&o->img->geo, slot, level, pos) < 0) return;
+  struct dirent *de = (struct dirent *)blk_ptr(o->img, addr);
+  for (uint j = 0; j < o->img->geo.dpb; j++, de++) {
+    if (strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) continue;
+    if (!is_orphan(o->img, o->refs, de->inum)) continue;
+    uf_union(o->uf, o->members, o->dinum, de->inum);
+    o->child[de->inum] |= de->inum != o->dinum;
+  }
+}
+
+// Detached subtree of orphans: its top inode, size and blocks, and the representative
+// its members map to
+typedef struct {
+  uint top;
+  uint members;
+  uint64_t blocks;
+  uint rep;
+  bool cycle; // No member is free of references from the others; top is the lowest
+} orphan_grp_t;
+
+// Order orphan groups by top inode
+int cmp_orphan_grp(const void *a, const void *b) {
+  const orphan_grp_t *x = a, *y = b;
+  return x->top < y->top ? -1 : x->top > y->top;
+}
+
+// Group every allocated inode the walk did not reach into detached subtrees, returned
+// in order of top inode. Each orphan directory is unioned with the orphans its entries
+// name, so a lost directory makes one group with its whole subtree. uf, of
+// sb.ninodes entries, is left leading each orphan to its group's representative.
+orphan_grp_t *orphan_groups(img_t *img, refs_t *refs, uint *uf, uint *ngrps) {
+  uint n = img->sb.ninodes;
+  uint *members = malloc(n * sizeof(uint));
+  uint *top = malloc(n * sizeof(uint));
+  uint *low = malloc(n * sizeof(uint));
+  uint64_t *blocks = calloc(n, sizeof(uint64_t));
+  bool *child = calloc(n, sizeof(bool));
+  for (uint i = 0; i < n; i++) {
+    uf[i] = i;
+    members[i] = 1;
+    top[i] = n;
+    low[i] = n;
+  }
+
+  // Union orphan directories with the orphans they refer to
+  orphan_uf_t o = { img, refs, uf, members, child, 0 };
+  for (uint i = 2; i < n; i++) {
+    struct dinode *in = inode_ptr(img, i);
+    if (!is_orphan(img, refs, i) || in->type != T_DIR) continue;
+    o.dinum = i;
+    walk_map(img, inode_addrs(&img->geo, in), union_orphan_blk, &o);
+  }
+
+  // Total each group; its top is the member no other orphan refers to, or the lowest
+  // inode when the group is a cycle. Inodes are visited in ascending order, so the
+  // first member seen of a group is its lowest.
+  orphan_grp_t *grps = malloc(n * sizeof(orphan_grp_t));
+  *ngrps = 0;
+  for (uint i = 2; i < n; i++) {
+    if (!is_orphan(img, refs, i)) continue;
+    uint r = uf_find(uf, i);
+    if (low[r] == n) low[r] = i;
+    blocks[r] += inode_blks(img, inode_ptr(img, i));
+    if (!child[i] && i < top[r]) top[r] = i;
+  }
+  for (uint i = 2; i < n; i++) {
+    if (!is_orphan(img, refs, i) || uf_find(uf, i) != i) continue;
+    grps[(*ngrps)++] = (orphan_grp_t){ top[i] < n ? top[i] : low[i], members[i], blocks[i], i,
+                                       top[i] == n };
+  }
+  qsort(grps, *ngrps, sizeof(orphan_grp_t), cmp_orphan_grp);
+
+  free(members);
+  free(top);
+  free(low);
+  free(blocks);
+  free(child);
+  return grps;
+}
+
+// Report every allocated inode the walk did not reach, grouped into detached subtrees,
+// so a lost directory shows up once with its whole subtree rather than once per inode
+void report_orphans(img_t *img, refs_t *refs) {
+  uint *uf = malloc(img->sb.ninodes * sizeof(uint));
+  uint ngrps;
+  orphan_grp_t *grps = orphan_groups(img, refs, uf, &ngrps);
+  fprintf(errf, "ERROR: inode marked use but not found in a directory.\n");
+  for (uint k = 0; k < ngrps; k++) {
+    fprintf(errf, "  detached subtree at inode %u: %u inode%s, %llu blocks\n", grps[k].top,
+            grps[k].members, grps[k].members == 1 ? "" : "s", (unsigned long long)grps[k].blocks);
+  }
+  free(uf);
+  free(grps);
+}
+
+// Check if an inode marked as used is actually in use, reporting all orphans at once the
+// first time one is met. Returns whether the inode is an orphan.
+bool chk_in_use(img_t *img, refs_t *refs, struct dinode *in, int idx, bool *reported) {
+  if (in->type == 0 || refs->inmap[idx] != 0) return false;
+  if (!*reported) report_orphans(img, refs);
+  *reported = true;
+  return true;
+}
+
+// Check if an inode referred to in a directory is marked as free
+bool chk_in_free(img_t *img, refs_t *refs, struct dinode *in, int idx) {
+  if (refs->inmap[idx] == 0 || in->type != 0) return false;
+  fprintf(errf, "ERROR: inode referred to in directory but marked free.\n");
+  print_paths(img, refs, idx);
+  return true;
+}
+
+// Check if the reference count of a file inode matches the directory entries
+bool chk_ref_cnt(img_t *img, refs_t *refs, struct dinode *in, int idx) {
+  if (in->type != T_FILE || in->nlink == refs->inmap[idx]) return false;
+  fprintf(errf, "ERROR: bad reference count for file.\n");
+  print_paths(img, refs, idx);
+  return true;
+}
+
+// Ensure a directory inode is only referenced once
+bool chk_dir_once(img_t *img, refs_t *refs, struct dinode *in, int idx) {
+  if (in->type != T_DIR || refs->inmap[idx] <= 1) return false;
+  fprintf(errf, "ERROR: directory appears more than once in file system.\n");
+  print_paths(img, refs, idx);
+  return true;
+}
+
+// Walk the directory tree from the root, building the reference map and parent table
+void run_refs(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  refs_t *refs = &ctx->refs;
+  refs->inmap = calloc(img->sb.ninodes, sizeof(int));
+  refs->links = calloc(img->sb.ninodes, sizeof(link_t));
+  refs->order = malloc(img->sb.ninodes * sizeof(uint));
+
+  refs->inmap[0]++;
+  refs->inmap[ROOTINO]++;
+  traverse_dirs(img, ROOTINO, refs);
+}
+
+// Reconcile the reference map with the inode columns without branching, returning
+// whether any inode fails one of the per-inode reference checks
+bool refs_bad(ctx_t *ctx) {
+  cols_t *c = &ctx->cols;
+  int *inmap = ctx->refs.inmap;
+  uint bad = 0, ninodes = ctx->img->sb.ninodes;
+  for (uint i = 2; i < ninodes; i++) {
+    int refs = inmap[i];
+    short type = c->type[i];
+    bad |= (type != 0) & (refs == 0);
+    bad |= (refs > 0) & (type == 0);
+    bad |= (type == T_FILE) & (c->nlink[i] != refs);
+    bad |= (type == T_DIR) & (refs > 1);
+  }
+  return bad;
+}
+
+// Main function to perform directory checks
+void dir_chk(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  refs_t *refs = &ctx->refs;
+
+  // Only when something is wrong walk the dinodes in order, so the first failing
+  // inode and check are the ones reported. With all set every failing inode is
+  // reported, each once, and the orphans once in all.
+  bool bad = false, orphans = false;
+  if (refs_bad(ctx)) {
+    for (uint i = 2; i < img->sb.ninodes && (ctx->all || !bad); i++) {
+      struct dinode *in = inode_ptr(img, i);
+      bad |= chk_in_use(img, refs, in, i, &orphans) || chk_in_free(img, refs, in, i) ||
+             chk_ref_cnt(img, refs, in, i) || chk_dir_once(img, refs, in, i);
+    }
+  }
+
+  // Parent links are checked last so the errors above keep their precedence
+  if (refs->badparent != 0 && (ctx->all || !bad)) {
+    fprintf(errf, "ERROR: parent link mismatch.\n");
+    fprintf(errf, "  '..' of inode %u names inode %u, but it was found in inode %u\n",
+            refs->badparent, refs->baddotdot, refs->links[refs->badparent].parent);
+    print_paths(img, refs, refs->badparent);
+    bad = true;
+  }
+
+  if (refs->dupdir != 0 && (ctx->all || !bad)) {
+    link_t at = { refs->dupdir, refs->dupslot };
+    fprintf(errf, "ERROR: duplicate name in directory.\n");
+    fprintf(errf, "  name '%.*s' appears more than once\n", DIRSIZ, link_dirent(img, &at)->name);
+    print_paths(img, refs, refs->dupdir);
+    bad = true;
+  }
+  if (bad) fail();
+}
+
+// Count the bits set in the first nbits bits of a bitmap
+uint64_t bmp_popcount(char *bmp, uint64_t nbits) {
+  uint64_t n = 0, i = 0;
+  for (; i + 64 <= nbits; i += 64) {
+    uint64_t w;
+    memcpy(&w, bmp + i / 8, sizeof(w));
+    n += __builtin_popcountll(w);
+  }
+  for (; i < nbits; i++) {
+    n += CHK_BIT(bmp, i) != 0;
+  }
+  return n;
+}
+
+// Count the indirect blocks a file of nblks logical blocks needs: in each tree it
+// reaches into, one block per nindirect^l of its blocks there at every level l
+uint64_t ind_blks(geo_t *g, uint64_t nblks) {
+  uint64_t n = 0;
+  for (uint k = 0; k < g->nlevels && nblks > g->ndirect + g->base[k]; k++) {
+    uint64_t rem = nblks - g->ndirect - g->base[k];
+    if (rem > g->span[k + 1]) rem = g->span[k + 1];
+    for (uint l = 1; l <= k + 1; l++) {
+      n += (rem + g->span[l] - 1) / g->span[l];
+    }
+  }
+  return n;
+}
+
+// Compare the blocks marked in the bitmap with the metadata blocks plus the blocks the
+// allocated inodes' sizes imply (data blocks and the indirect blocks past the direct
+// ones). With a single indirect slot that is one block past the direct ones, counted
+// without branching.
+void bmp_count_chk(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  cols_t *c = &ctx->cols;
+  geo_t *g = &img->geo;
+  uint64_t used = img->firstblk;
+  uint ninodes = img->sb.ninodes;
+  if (g->nlevels == 1) {
+    for (uint i = 0; i < ninodes; i++) {
+      uint64_t nblks = (c->type[i] != 0) * size_blks(g, c->size[i]);
+      used += nblks + (nblks > g->ndirect);
+    }
+  } else {
+    for (uint i = 0; i < ninodes; i++) {
+      uint64_t nblks = (c->type[i] != 0) * size_blks(g, c->size[i]);
+      used += nblks + ind_blks(g, nblks);
+    }
+  }
+
+  uint64_t marked = 0;
+  for (uint64_t b = 0; b * g->bpb < img->sb.size; b++) {
+    uint64_t nbits = img->sb.size - b * g->bpb;
+    marked += bmp_popcount(blk_ptr(img, img->sb.bmapstart + b), nbits < g->bpb ? nbits : g->bpb);
+  }
+  if (marked != used) {
+    fprintf(errf, "ERROR: bitmap block count does not match blocks in use.\n");
+    fprintf(errf, "  %llu blocks marked in bitmap, %llu in use (%llu metadata)\n",
+            (unsigned long long)marked, (unsigned long long)used,
+            (unsigned long long)img->firstblk);
+    fail();
+  }
+}
+
+// Check that the root directory exists and is properly formatted
+void root_chk(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  struct dinode *root = inode_ptr(img, ROOTINO);
+  if (root->type != T_DIR) {
+    fprintf(errf, "ERROR: root directory does not exist.\n");
+    fail();
+  }
+  void *addrs = inode_addrs(&img->geo, root);
+  uint64_t slots[MAXLEVELS];
+  read_slots(&img->geo, root, slots);
+  check_direct(img, ROOTINO, addrs);
+  check_indirect(img, ROOTINO, slots, NULL);
+  validate_dir(img, addrs, ROOTINO);
+}
+
+// Build the list of allocated inodes and extract the inode columns, in one pass over
+// the inode table
+void run_alloc_list(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  cols_t *c = &ctx->cols;
+  uint ninodes = img->sb.ninodes;
+  ctx->alloc = malloc(ninodes * sizeof(uint));
+  c->type = malloc(ninodes * sizeof(short));
+  c->nlink = malloc(ninodes * sizeof(short));
+  c->size = malloc(ninodes * sizeof(uint64_t));
+  c->indirect = malloc(ninodes * sizeof(uint64_t));
+
+  for (uint i = 0; i < ninodes; i++) {
+    struct dinode *in = inode_ptr(img, i);
+    void *addrs = inode_addrs(&img->geo, in);
+    uint64_t ind = 0;
+    for (uint k = 0; k < img->geo.nlevels; k++) {
+      ind |= addr_at(&img->geo, addrs, img->geo.ndirect + k);
+    }
+    c->type[i] = in->type;
+    c->nlink[i] = in->nlink;
+    c->size[i] = inode_size(&img->geo, in);
+    c->indirect[i] = ind;
+    ctx->alloc[ctx->nalloc] = i;
+    ctx->nalloc += in->type != 0;
+  }
+}
+
+// Validate the type of every allocated inode. The common all-valid case is settled by
+// one branch-free sweep; only then is the error located and reported.
+void run_validate_type(ctx_t *ctx) {
+  cols_t *c = &ctx->cols;
+  uint bad = 0, ninodes = ctx->img->sb.ninodes;
+  for (uint i = 0; i < ninodes; i++) {
+    short t = c->type[i];
+    bad |= (t != 0) & (t != T_FILE) & (t != T_DIR) & (t != T_DEV);
+  }
+  if (!bad) return;
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    validate_type(c->type[ctx->alloc[k]]);
+  }
+}
+
+// Validate the direct addresses of every allocated inode. The slot masks of all inodes
+// are OR-ed together without branching, which settles the common case; only then are
+// the inodes checked one by one to report the first offender. The indirect slots' bits
+// are left to check_indirect, which reports them.
+void run_check_direct(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  uint bad = 0, direct = DIRECT_SLOTS(img->geo.ndirect);
+  uint *ndirect = malloc(ctx->nalloc * sizeof(uint));
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    void *addrs = inode_addrs(&img->geo, inode_ptr(img, ctx->alloc[k]));
+    bad |= img->kern->bad_slots(img, addrs) & direct;
+    ndirect[k] = img->kern->last_direct(img, addrs);
+  }
+  for (uint k = 0; bad && k < ctx->nalloc; k++) {
+    check_direct(img, ctx->alloc[k], inode_addrs(&img->geo, inode_ptr(img, ctx->alloc[k])));
+  }
+  ctx->ndirect = ndirect;
+}
+
+// Validate the indirect addresses of every allocated inode. A single indirect slot is
+// read from its column; several are read from the dinode. For --report, each block list
+// is followed in the same pass to gather the statistics.
+void run_check_indirect(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  stats_t *st = ctx->stats;
+  uint64_t *nindirect = malloc(ctx->nalloc * sizeof(uint64_t));
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    uint inum = ctx->alloc[k];
+    uint64_t slots[MAXLEVELS];
+    if (img->geo.nlevels == 1) {
+      slots[0] = ctx->cols.indirect[inum];
+    } else {
+      read_slots(&img->geo, inode_ptr(img, inum), slots);
+    }
+    if (st) stats_start(st, &img->geo, inode_addrs(&img->geo, inode_ptr(img, inum)));
+    nindirect[k] = check_indirect(img, inum, slots, st);
+    if (st && ctx->cols.type[inum] == T_FILE) stats_file(st, inum, ctx->cols.size[inum]);
+  }
+  ctx->nindirect = nindirect;
+}
+
+// Validate the format of every directory but the root, which root_chk covers
+void run_validate_dir(ctx_t *ctx) {
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    uint inum = ctx->alloc[k];
+    if (ctx->cols.type[inum] == T_DIR && inum != ROOTINO) {
+      validate_dir(ctx->img, inode_addrs(&ctx->img->geo, inode_ptr(ctx->img, inum)), inum);
+    }
+  }
+}
+
+// Check the size of every allocated inode against the blocks it has allocated
+void run_chk_size(ctx_t *ctx) {
+  cols_t *c = &ctx->cols;
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    uint inum = ctx->alloc[k];
+    const char *err = chk_size(ctx->img, c->type[inum], c->size[inum],
+                               c->indirect[inum] != 0, ctx->ndirect[k], ctx->nindirect[k]);
+    if (err) {
+      fprintf(errf, "%s", err);
+      fprintf(errf, "  inode %u: size %llu\n", inum, (unsigned long long)c->size[inum]);
+      fail();
+    }
+  }
+}
+
+// Every check and producer of derived data. Order sets precedence: when several checks
+// fail, the one listed first is reported. Checks added after the original set come
+// last so they never mask the errors the original serial checker reported.
+check_t checks[] = {
+  { "alloc_list",     TIER_QUICK,    0,                             D_ALLOC,    run_alloc_list,    false },
+  { "validate_type",  TIER_STANDARD, D_ALLOC,                       0,          run_validate_type, false },
+  { "check_direct",   TIER_STANDARD, D_ALLOC,                       D_DIRECT,   run_check_direct,  false },
+  { "check_indirect", TIER_STANDARD, D_ALLOC,                       D_INDIRECT, run_check_indirect, false },
+  { "root_chk",       TIER_QUICK,    0,                             0,          root_chk,          false },
+  { "validate_dir",   TIER_STANDARD, D_ALLOC | D_DIRECT,            0,          run_validate_dir,  false },
+  { "claimed",        TIER_STANDARD, D_ALLOC | D_DIRECT | D_INDIRECT, D_CLAIMED, run_claimed,       false },
+  { "chk_bmp_addr",   TIER_STANDARD, D_CLAIMED,                     0,          chk_bmp_addr,      false },
+  { "addrs_chk",      TIER_STANDARD, D_CLAIMED,                     0,          addrs_chk,         false },
+  { "refs",           TIER_FULL,     D_DIRECT | D_INDIRECT,         D_REFS,     run_refs,          false },
+  { "dir_chk",        TIER_FULL,     D_REFS,                        0,          dir_chk,           false },
+  { "chk_size",       TIER_STANDARD, D_ALLOC | D_DIRECT | D_INDIRECT, 0,        run_chk_size,      false },
+  { "bmp_chk",        TIER_STANDARD, D_CLAIMED,                     0,          bmp_chk,           false },
+  { "bmp_count_chk",  TIER_QUICK,    D_ALLOC,                       0,          bmp_count_chk,     true },
+};
+
+#define NCHECKS (sizeof(checks) / sizeof(checks[0]))
+
+// Thread body of a scheduled check
+void *run_task(void *arg) {
+  task_t *t = arg;
+  cur_task = t;
+  errf = t->out;
+  t->chk->run(t->ctx);
+  return NULL;
+}
+
+// Run the wanted checks, with the producers of the derived data they need and of the
+// needed data. Each round starts, on their own threads, all checks whose inputs are
+// ready, so every derived input is computed once and independent checks run
+// concurrently. Output is captured per check and the first failure in registry order is
+// reported (or every failure, in registry order, when all is set), which keeps the
+// outcome independent of thread timing. Checks whose inputs could not be produced
+// because their producer failed are skipped.
+void run_tasks(ctx_t *ctx, bool *want, uint needed, bool all) {
+  task_t tasks[NCHECKS];
+  uint have = 0;
+
+  // Add the producers of everything needed
+  for (uint i = 0; i < NCHECKS; i++) {
+    if (want[i]) needed |= checks[i].needs;
+  }
+  for (bool grew = true; grew; ) {
+    grew = false;
+    for (uint i = 0; i < NCHECKS; i++) {
+      if (!want[i] && (checks[i].makes & needed)) {
+        want[i] = grew = true;
+        needed |= checks[i].needs;
+      }
+    }
+  }
+
+  ctx->all = all;
+  memset(tasks, 0, sizeof(tasks));
+  for (;;) {
+    pthread_t th[NCHECKS];
+    uint batch[NCHECKS], nbatch = 0;
+    for (uint i = 0; i < NCHECKS; i++) {
+      if (want[i] && !tasks[i].ran && (checks[i].needs & ~have) == 0) {
+        batch[nbatch++] = i;
+      }
+    }
+    if (nbatch == 0) break;
+
+    for (uint k = 0; k < nbatch; k++) {
+      task_t *t = &tasks[batch[k]];
+      t->chk = &checks[batch[k]];
+      t->ctx = ctx;
+      t->out = open_memstream(&t->buf, &t->len);
+      t->ran = true;
+      if (pthread_create(&th[k], NULL, run_task, t) != 0) {
+        perror("pthread_create");
+        exit(1);
+      }
+    }
+    for (uint k = 0; k < nbatch; k++) {
+      task_t *t = &tasks[batch[k]];
+      pthread_join(th[k], NULL);
+      fclose(t->out);
+      if (!t->failed) have |= t->chk->makes;
+    }
+  }
+
+  bool failed = false;
+  for (uint i = 0; i < NCHECKS && (all || !failed); i++) {
+    if (tasks[i].failed) {
+      fwrite(tasks[i].buf, 1, tasks[i].len, stderr);
+      failed = true;
+    }
+  }
+  if (failed) exit(1);
+}
+
+// Run every check of the given tier and below, along with the producers of the derived
+// data in needs
+void run_checks(ctx_t *ctx, int tier, uint needs, bool all) {
+  bool want[NCHECKS];
+  for (uint i = 0; i < NCHECKS; i++) {
+    want[i] = checks[i].only ? checks[i].tier == tier : checks[i].tier <= tier;
+  }
+  run_tasks(ctx, want, needs, all);
+}
+
+// Build derived data for a tool, running only its producers. A producer that fails
+// reports its error as a check would, and the tool does not run.
+void make_data(ctx_t *ctx, uint needs) {
+  bool want[NCHECKS] = { false };
+  run_tasks(ctx, want, needs, false);
+}
+
+// Print 2^k with a binary unit prefix
+void put_pow2(FILE *f, uint k) {
+  static const char units[] = " KMGTPE";
+  fprintf(f, "%llu%.*s", 1ULL << k % 10, k >= 10, &units[k / 10]);
+}
+
+// Print the non-empty buckets of a histogram, as text rows or as a JSON array
+void put_hist(FILE *f, const char *what, uint64_t *h, bool json) {
+  bool first = true;
+  if (!json) fprintf(f, "  %-14s %12s\n", what, "count");
+  for (uint b = 0; b < 65; b++) {
+    if (h[b] == 0) continue;
+    if (json) {
+      uint64_t lo = b ? 1ULL << (b - 1) : 0, hi = b ? (b == 64 ? ~0ULL : (1ULL << b) - 1) : 0;
+      fprintf(f, "%s{\"min\": %llu, \"max\": %llu, \"count\": %llu}", first ? "" : ", ",
+              (unsigned long long)lo, (unsigned long long)hi, (unsigned long long)h[b]);
+      first = false;
+      continue;
+    }
+    char label[32] = "0";
+    if (b > 0) {
+      FILE *l = fmemopen(label, sizeof(label), "w");
+      fprintf(l, "[");
+      put_pow2(l, b - 1);
+      fprintf(l, ", ");
+      put_pow2(l, b);
+      fprintf(l, ")");
+      fclose(l);
+    }
+    fprintf(f, "  %-14s %12llu\n", label, (unsigned long long)h[b]);
+  }
+}
+
+// Print the statistics gathered for --report, with directory fan-out counted from the
+// entries the walk recorded, as text or JSON
+void print_report(ctx_t *ctx, bool json) {
+  img_t *img = ctx->img;
+  stats_t *st = ctx->stats;
+  refs_t *refs = &ctx->refs;
+  uint n = img->sb.ninodes;
+  uint *entries = calloc(n, sizeof(uint));
+  uint64_t fanout[65] = { 0 }, dirs = 0;
+  for (uint i = 2; i < n; i++) {
+    if (refs->inmap[i] > 0) entries[refs->links[i].parent]++;
+  }
+  for (uint k = 0; k < refs->nextra; k++) {
+    entries[refs->extra[k].at.parent]++;
+  }
+  for (uint i = ROOTINO; i < n; i++) {
+    if (ctx->cols.type[i] != T_DIR || (i != ROOTINO && refs->inmap[i] == 0)) continue;
+    fanout[bucket(entries[i])]++;
+    dirs++;
+  }
+  free(entries);
+
+  double mean = st->files ? (double)st->totruns / st->files : 0;
+  if (json) {
+    printf("{\"files\": {\"count\": %llu, \"bytes\": %llu, \"sizes\": [", (unsigned long long)st->files,
+           (unsigned long long)st->bytes);
+    put_hist(stdout, NULL, st->sizes, true);
+    printf("]},\n \"directories\": {\"count\": %llu, \"fanout\": [", (unsigned long long)dirs);
+    put_hist(stdout, NULL, fanout, true);
+    printf("]},\n \"indirect\": [");
+    for (uint l = 0; l < img->geo.nlevels; l++) {
+      printf("%s{\"level\": %u, \"blocks\": %llu, \"entries\": %llu, \"fill\": %.4f}", l ? ", " : "",
+             l + 1, (unsigned long long)st->ind[l], (unsigned long long)st->indused[l],
+             st->ind[l] ? (double)st->indused[l] / (st->ind[l] * img->geo.nindirect) : 0);
+    }
+    printf("],\n \"runs\": {\"total\": %llu, \"mean\": %.3f, \"fragmented\": %llu, \"worst\": "
+           "{\"inode\": %u, \"runs\": %llu}, \"per_file\": [", (unsigned long long)st->totruns, mean,
+           (unsigned long long)st->fragmented, st->worst, (unsigned long long)st->worstruns);
+    put_hist(stdout, NULL, st->nruns, true);
+    printf("]}}\n");
+    return;
+  }
+
+  printf("files: %llu, %llu bytes\n", (unsigned long long)st->files, (unsigned long long)st->bytes);
+  put_hist(stdout, "size (bytes)", st->sizes, false);
+  printf("directories: %llu\n", (unsigned long long)dirs);
+  put_hist(stdout, "entries", fanout, false);
+  printf("indirect blocks:\n");
+  for (uint l = 0; l < img->geo.nlevels; l++) {
+    if (st->ind[l] == 0) continue;
+    printf("  level %u: %llu blocks, %.1f%% of their entries used\n", l + 1,
+           (unsigned long long)st->ind[l],
+           100.0 * st->indused[l] / (st->ind[l] * img->geo.nindirect));
+  }
+  printf("runs: %llu in all, %.2f per file; %llu file%s in more than one", (unsigned long long)st->totruns,
+         mean, (unsigned long long)st->fragmented, st->fragmented == 1 ? "" : "s");
+  if (st->worstruns > 1) {
+    printf(", most in inode %u (%llu)", st->worst, (unsigned long long)st->worstruns);
+  }
+  printf("\n");
+  put_hist(stdout, "runs per file", st->nruns, false);
+}
+
+// Reject a superblock whose geometry does not fit the image
+void bad_sb(const char *why) {
+  fprintf(stderr, "ERROR: bad superblock.\n");
+  fprintf(stderr, "  %s\n", why);
+  exit(1);
+}
+
+// Reject a log header that xv6's recovery could not have written
+void bad_log(const char *why) {
+  fprintf(stderr, "ERROR: bad log header.\n");
+  fprintf(stderr, "  %s\n", why);
+  exit(1);
+}
+
+// Fill in a geometry from its block size, direct and indirect slot counts and address
+// width, returning false if the checker cannot handle it: blocks must be a power of two
+// that holds a dinode, addresses 4 or 8 bytes, trees at most MAXLEVELS deep, and addrs[]
+// must fit the 32-bit slot masks. In the 64-bit address format a dinode's size is a
+// 64-bit word, so addrs[] starts 16 bytes in.
+bool set_geo(geo_t *g, uint bsize, uint ndirect, uint nlevels, uint asize) {
+  uint aoff = asize == 8 ? 16 : offsetof(struct dinode, addrs);
+  uint isize = aoff + (ndirect + nlevels) * asize;
+  if (asize != 4 && asize != 8) return false;
+  if (bsize < 512 || bsize > 65536 || (bsize & (bsize - 1)) != 0) return false;
+  if (ndirect == 0 || nlevels == 0 || nlevels > MAXLEVELS) return false;
+  if (ndirect + nlevels >= 32 || isize > bsize) return false;
+
+  g->bsize = bsize;
+  g->bshift = __builtin_ctz(bsize);
+  g->asize = asize;
+  g->aoff = aoff;
+  g->ndirect = ndirect;
+  g->nlevels = nlevels;
+  g->nindirect = bsize / asize;
+  g->span[0] = 1;
+  g->base[0] = 0;
+  for (uint l = 1; l <= MAXLEVELS; l++) {
+    g->span[l] = g->span[l - 1] * g->nindirect;
+    g->base[l] = g->base[l - 1] + g->span[l];
+  }
+
+  // A 32-bit size reaches the first 4 GB of a file, a 64-bit one every block of its trees
+  uint64_t tree = ndirect + g->base[nlevels], sizeblks = ~0ULL >> g->bshift;
+  g->maxblks = asize == 4 ? (1ULL << 32) >> g->bshift : tree < sizeblks ? tree : sizeblks;
+  g->isize = isize;
+  g->ipb = bsize / isize;
+  g->bpb = bsize * 8;
+  g->dpb = bsize / sizeof(struct dirent);
+  g->packed = bsize % isize == 0;
+  return true;
+}
+
+// Read the superblock of an image at least two blocks long in the given geometry. One
+// led by FSMAGIC64 is in the 64-bit address format, which always has the later layout.
+// Otherwise a non-zero inodestart tells the later layouts from the original one, whose
+// superblock is followed by zeroes.
+void read_sb(sb_t *sb, char *mmap, geo_t *g) {
+  uint64_t x[8];
+  memcpy(x, mmap + g->bsize, sizeof(x));
+  if (x[0] == FSMAGIC64) {
+    sb->asize = 8;
+    sb->size = x[1];
+    sb->nblocks = x[2];
+    sb->ninodes = x[3];
+    sb->nlog = x[4];
+    sb->logstart = x[5];
+    sb->inodestart = x[6];
+    sb->bmapstart = x[7];
+    return;
+  }
+
+  uint w[8];
+  memcpy(w, mmap + g->bsize, sizeof(w));
+  uint *f = w[0] == FSMAGIC ? w + 1 : w;
+  sb->asize = 4;
+  sb->size = f[0];
+  sb->nblocks = f[1];
+  sb->ninodes = f[2];
+  sb->nlog = f[3];
+  if (f[5] != 0) {
+    sb->logstart = f[4];
+    sb->inodestart = f[5];
+    sb->bmapstart = f[6];
+  } else {
+    sb->logstart = 0;
+    sb->inodestart = 2;
+    sb->bmapstart = 2 + sb->ninodes / g->ipb + 1;
+  }
+}
+
+// Add two block counts of a superblock, saturating where 64-bit fields would overflow
+uint64_t blk_add(uint64_t a, uint64_t b) {
+  uint64_t sum;
+  return __builtin_add_overflow(a, b, &sum) ? UINT64_MAX : sum;
+}
+
+// Get the block after the last of the log, inode and bitmap regions, where data starts.
+// ninodes must fit 32 bits.
+uint64_t meta_end(sb_t *sb, geo_t *g) {
+  uint64_t end = blk_add(sb->inodestart, sb->ninodes / g->ipb + 1);
+  uint64_t bmapend = blk_add(sb->bmapstart, sb->size / g->bpb + 1);
+  uint64_t logend = blk_add(sb->logstart, sb->nlog);
+  if (bmapend > end) end = bmapend;
+  if (sb->logstart && logend > end) end = logend;
+  return end;
+}
+
+// Check whether the addrs[] slots of an inode in use are those its size needs
+bool slots_fit(geo_t *g, struct dinode *in) {
+  uint64_t nblks = size_blks(g, inode_size(g, in));
+  void *addrs = inode_addrs(g, in);
+  if (nblks > g->ndirect + g->base[g->nlevels]) return false;
+  for (uint s = 0; s < g->ndirect; s++) {
+    if ((addr_at(g, addrs, s) != 0) != (s < nblks)) return false;
+  }
+  for (uint k = 0; k < g->nlevels; k++) {
+    if ((addr_at(g, addrs, g->ndirect + k) != 0) != (nblks > g->ndirect + g->base[k])) return false;
+  }
+  return true;
+}
+
+// Rate how well a geometry fits an image: -1 if the superblock it locates is not in the
+// geometry's address format or does not describe exactly the mapped length, 0 unless
+// the root inode is then a directory whose first block starts with '.', and otherwise
+// 1 plus the number of the first FIT_SAMPLE inodes whose slots in use match their
+// sizes. The count tells apart layouts with the same dinode size, such as 12 direct
+// slots and an indirect one from 11 direct slots, an indirect and a double-indirect one.
+int geo_fit(geo_t *g, char *mmap, off_t len) {
+  if (len < 2 * (off_t)g->bsize) return -1;
+  sb_t sb;
+  read_sb(&sb, mmap, g);
+  if (sb.asize != g->asize || sb.ninodes <= ROOTINO || sb.ninodes > UINT32_MAX) return -1;
+  if (sb.size != (uint64_t)len >> g->bshift || (len & (g->bsize - 1)) != 0) return -1;
+  uint64_t firstblk = meta_end(&sb, g);
+  if (firstblk >= sb.size) return -1;
+
+  char *itab = mmap + ((size_t)sb.inodestart << g->bshift);
+  struct dinode *root = (struct dinode *)(itab + ROOTINO * g->isize);
+  uint64_t addr = addr_at(g, inode_addrs(g, root), 0);
+  if (root->type != T_DIR || addr < firstblk || addr >= sb.size) return 0;
+  struct dirent *de = (struct dirent *)(mmap + ((size_t)addr << g->bshift));
+  if (de->inum != ROOTINO || strcmp(de->name, ".") != 0) return 0;
+
+  int fit = 1;
+  uint n = sb.ninodes < FIT_SAMPLE ? sb.ninodes : FIT_SAMPLE;
+  for (uint i = ROOTINO; i < n; i++) {
+    struct dinode *in = (struct dinode *)(itab + ((size_t)(i / g->ipb) << g->bshift) +
+                                          i % g->ipb * g->isize);
+    fit += (in->type == T_FILE || in->type == T_DIR) && slots_fit(g, in);
+  }
+  return fit;
+}
+
+// Work out the geometry of an image from its superblock, trying every geometry with
+// specialized kernels, with the block size or slot counts replaced by those forced on
+// the command line if any (0 when not). The address width always comes from the
+// geometry tried, so only those of the superblock's format fit; the default geometry
+// takes the width of the superblock it locates. The best fit wins, the earliest on a
+// tie. Returns false if the forced geometry cannot be handled.
+bool detect_geo(geo_t *g, char *mmap, off_t len, uint bsize, uint ndirect, uint nlevels) {
+  uint b0 = bsize ? bsize : BSIZE;
+  uint64_t magic = 0;
+  if (len >= 2 * (off_t)b0) memcpy(&magic, mmap + b0, sizeof(magic));
+  if (!set_geo(g, b0, ndirect ? ndirect : NDIRECT, nlevels ? nlevels : 1,
+               magic == FSMAGIC64 ? 8 : 4)) {
+    return false;
+  }
+  int best = geo_fit(g, mmap, len);
+  for (uint k = 0; k < NGEOS; k++) {
+    geo_t c;
+    uint b = bsize ? bsize : geo_kerns[k].bsize;
+    uint n = ndirect ? ndirect : geo_kerns[k].ndirect;
+    uint l = nlevels ? nlevels : geo_kerns[k].nlevels;
+    if (!set_geo(&c, b, n, l, geo_kerns[k].asize)) continue;
+    int fit = geo_fit(&c, mmap, len);
+    if (fit > best) {
+      best = fit;
+      *g = c;
+    }
+  }
+  return true;
+}
+
+// Enter a block into the overlay, a later copy replacing an earlier one. The table
+// doubles whenever it would become more than half full.
+void ovl_put(img_t *img, uint64_t blk, char *data) {
+  uint cap = img->ovl ? 1u << (32 - img->ovl_shift) : 0;
+  if (2 * (img->novl + 1) > cap) {
+    ovl_t *old = img->ovl;
+    img->ovl = calloc(cap ? 2 * cap : 16, sizeof(ovl_t));
+    img->ovl_shift = cap ? img->ovl_shift - 1 : 28;
+    img->novl = 0;
+    for (uint h = 0; h < cap; h++) {
+      if (old[h].blk != 0) ovl_put(img, old[h].blk, old[h].data);
+    }
+    free(old);
+  }
+
+  uint mask = ~0u >> img->ovl_shift;
+  uint h = ovl_slot(img, blk);
+  while (img->ovl[h].blk != 0 && img->ovl[h].blk != blk) h = (h + 1) & mask;
+  if (img->ovl[h].blk == 0) img->novl++;
+  img->ovl[h] = (ovl_t){ blk, data };
+}
+
+// Replay the transaction committed to the log but not yet installed, as xv6's recovery
+// would, without writing the image: each logged block is entered into the overlay at
+// its copy in the log, which blk_ptr() then serves in its place. The header block holds
+// the count n and the n home addresses, words as wide as a block address; copy i
+// follows it at logstart + 1 + i.
+void replay_log(img_t *img) {
+  sb_t *sb = &img->sb;
+  if (sb->logstart == 0 || sb->nlog == 0) return;
+  void *hdr = blk_ptr(img, sb->logstart);
+  uint64_t n = addr_at(&img->geo, hdr, 0);
+  if (n == 0) return;
+  if (n >= sb->nlog || n >= img->geo.nindirect) bad_log("more blocks logged than the log holds");
+
+  for (uint i = 0; i < n; i++) {
+    uint64_t blk = addr_at(&img->geo, hdr, 1 + i);
+    if (blk < 2 || blk >= sb->size || (blk >= sb->logstart && blk < sb->logstart + sb->nlog)) {
+      fprintf(stderr, "ERROR: bad log header.\n");
+      fprintf(stderr, "  block[%u] = %llu\n", i, (unsigned long long)blk);
+      exit(1);
+    }
+    ovl_put(img, blk, img->map + ((size_t)(sb->logstart + 1 + i) << img->geo.bshift));
+  }
+}
+
+// Initialize the image structure with mmap and other details, validating that every
+// region the superblock describes, in the given geometry, lies inside the len bytes
+// that were mapped, then replay any pending log transaction over it
+void init_img(img_t *img, char *mmap, off_t len, geo_t *geo) {
+  img->geo = *geo;
+  img->kern = find_kern(geo);
+  img->ovl = NULL;
+  img->novl = 0;
+  if (len < 2 * (off_t)geo->bsize) bad_sb("image too small to hold a superblock");
+
+  img->map = mmap;
+  img->len = len;
+  img->pgmask = sysconf(_SC_PAGESIZE) - 1;
+  read_sb(&img->sb, mmap, geo);
+  sb_t *sb = &img->sb;
+  if (sb->ninodes <= ROOTINO) bad_sb("no room for the root inode");
+  if (sb->ninodes > UINT32_MAX) bad_sb("more inodes than 32-bit inode numbers name");
+  if (sb->size > (uint64_t)len >> geo->bshift) bad_sb("size extends past the end of the image");
+
+  img->ninodeblks = (sb->ninodes / geo->ipb) + 1;
+  img->nbitmapblks = (sb->size / geo->bpb) + 1;
+  uint64_t end = meta_end(sb, geo);
+  if (end > sb->size) bad_sb("inode and bitmap blocks extend past size");
+  uint64_t ilo = sb->inodestart, ihi = ilo + img->ninodeblks;
+  uint64_t blo = sb->bmapstart, bhi = blo + img->nbitmapblks;
+  uint64_t llo = sb->logstart, lhi = llo + sb->nlog;
+  if (ilo < 2 || blo < 2 || (llo != 0 && llo < 2)) bad_sb("metadata overlaps the superblock");
+  if ((ilo < bhi && blo < ihi) || (llo != 0 && ((llo < ihi && ilo < lhi) || (llo < bhi && blo < lhi)))) {
+    bad_sb("log, inode and bitmap blocks overlap");
+  }
+
+  img->inodeblks = blk_ptr(img, sb->inodestart);
+  img->bitmapblks = blk_ptr(img, sb->bmapstart);
+  img->firstblk = end;
+  img->data = blk_ptr(img, img->firstblk);
+  if (sb->nblocks > sb->size - img->firstblk) bad_sb("more data blocks than fit in size");
+
+  replay_log(img);
+}
+
+// Open and map an image, work out its geometry, with the block size and slot counts
+// forced when not 0, and initialize img. Returns the file descriptor, opened with flags.
+int open_img(img_t *img, const char *fname, int flags, uint bsize, uint ndirect, uint nlevels) {
+  int fd = open(fname, flags);
+  if (fd < 0) {
+    perror(fname);
+    exit(1);
   }
 
   // Get file status
-  if (fstat(fsfd, &fsStat) < 0) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
     exit(1);
   }
 
   // Memory-map the file system image
-  mmap_img = mmap(NULL, fsStat.st_size, PROT_READ, MAP_PRIVATE, fsfd, 0);
-  if (mmap_img == MAP_FAILED) {
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
     perror("mmap failed");
     exit(1);
   }
 
-  // Initialize image data structure
-  init_img(&img, mmap_img, argv[1]);
+  // Work out the geometry and initialize image data structure
+  geo_t geo;
+  if (!detect_geo(&geo, map, st.st_size, bsize, ndirect, nlevels)) {
+    fprintf(stderr, "ERROR: unsupported geometry.\n");
+    exit(1);
+  }
+  init_img(img, map, st.st_size, &geo);
+  return fd;
+}
+
+// Compute bitmap block b as it should read: every metadata block and every block claimed
+// by an allocated inode marked, every other block free, and the bits past size kept as
+// they are. Each 32-bit word of the block is built from one word of usage counters.
+void build_bmp_blk(img_t *img, uint64_t *claimed, uint64_t b, char *out) {
+  geo_t *g = &img->geo;
+  char *old = blk_ptr(img, img->sb.bmapstart + b);
+  for (uint off = 0; off < g->bsize; off += sizeof(uint32_t)) {
+    uint64_t blk = b * g->bpb + (uint64_t)off * 8;
+    uint32_t w;
+    memcpy(&w, old + off, sizeof(w));
+    if (blk < img->sb.size) {
+      uint32_t want = claimed_bits(claimed[blk / CNT_PER_WORD]);
+      if (blk < img->firstblk) {
+        want |= img->firstblk - blk >= 32 ? ~0u : (1u << (img->firstblk - blk)) - 1;
+      }
+      uint32_t live = img->sb.size - blk >= 32 ? ~0u : (1u << (img->sb.size - blk)) - 1;
+      w = (w & ~live) | (want & live);
+    }
+    memcpy(out + off, &w, sizeof(w));
+  }
+}
+
+// Run of adjacent blocks whose bitmap bits flip the same way, printed by the dry run
+typedef struct {
+  uint64_t start, end; // Blocks [start, end); empty when equal
+  bool mark;           // Free blocks to mark, rather than marked blocks to free
+} bmp_run_t;
 
-  // Iterate through inodes and perform various checks
-  img_t *img2 = &img;
-  struct dinode *in = (struct dinode *)(img2->inodeblks);
-  bool *chk_blks = calloc(img2->sb->size, sizeof(bool));
-  for (int i = 0; i < img2->sb->ninodes; i++, in++) {
-    if (in->type == 0) continue;
+// Print a run of flipped bits, if any, and empty it
+void flush_bmp_run(bmp_run_t *r) {
+  if (r->start == r->end) return;
+  printf("  %s %llu", r->mark ? "mark" : "free", (unsigned long long)r->start);
+  if (r->end - r->start > 1) printf("-%llu", (unsigned long long)r->end - 1);
+  printf("\n");
+  r->start = r->end;
+}
 
-    validate_type(in);
-    check_direct(img2, in);
-    check_indirect(img2, in);
-    if (i == 1) {
-      // Special case for root directory
-      if (in->type != T_DIR) {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        exit(1);
+// Print the blocks whose bits differ between the old and rebuilt bitmap block b, as runs
+// of blocks to mark and to free. Only words that differ are looked into.
+void print_bmp_diff(img_t *img, uint64_t b, char *old, char *new) {
+  geo_t *g = &img->geo;
+  bmp_run_t r = { 0, 0, false };
+  printf("bitmap block %llu (blocks %llu-%llu):\n", (unsigned long long)(img->sb.bmapstart + b),
+         (unsigned long long)b * g->bpb, (unsigned long long)(b + 1) * g->bpb - 1);
+  for (uint off = 0; off < g->bsize; off += sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, old + off, sizeof(x));
+    memcpy(&y, new + off, sizeof(y));
+    for (uint64_t d = x ^ y; d != 0; d &= d - 1) {
+      uint bit = __builtin_ctzll(d);
+      uint64_t blk = b * g->bpb + (uint64_t)off * 8 + bit;
+      bool mark = (y >> bit) & 1;
+      if (blk != r.end || mark != r.mark) {
+        flush_bmp_run(&r);
+        r = (bmp_run_t){ blk, blk, mark };
       }
-      validate_dir(img2, in, 1);
-    } else if (in->type == T_DIR) {
-      validate_dir(img2, in, i);
+      r.end++;
     }
-    chk_bmp_addr(img2, in);
   }
+  flush_bmp_run(&r);
+}
+
+// Write blocks of bsize bytes from n buffers, given in ascending block order: one pwritev
+// per run of adjacent blocks, of at most the system's limit of buffers per call
+void write_blks(int fd, uint bsize, uint64_t *blks, char **bufs, uint n) {
+  uint maxiov = sysconf(_SC_IOV_MAX);
+  struct iovec *iov = malloc((n < maxiov ? n : maxiov) * sizeof(struct iovec));
+  for (uint k = 0; k < n; ) {
+    uint m = 0;
+    while (k + m < n && m < maxiov && blks[k + m] == blks[k] + m) {
+      iov[m] = (struct iovec){ bufs[k + m], bsize };
+      m++;
+    }
+    ssize_t len = (ssize_t)m * bsize;
+    if (pwritev(fd, iov, m, (off_t)(blks[k] * bsize)) != len) {
+      perror("pwritev");
+      exit(1);
+    }
+    k += m;
+  }
+  if (n > 0 && fdatasync(fd) != 0) {
+    perror("fdatasync");
+    exit(1);
+  }
+  free(iov);
+}
+
+// Rebuild the free bitmap from the metadata region and the blocks claimed by allocated
+// inodes, comparing it with the image's a block at a time, and write back only the
+// bitmap blocks that changed. With dry_run the differences are printed instead. Block
+// maps must pass the address checks first, and an image whose log holds a pending
+// transaction is left alone: recovery would install the logged blocks over the new ones.
+void rebuild_bitmap(img_t *img, int fd, bool dry_run) {
+  if (img->novl) {
+    fprintf(stderr, "ERROR: log transaction pending.\n");
+    fprintf(stderr, "  boot the image or replay its log before rebuilding the bitmap\n");
+    exit(1);
+  }
+  ctx_t ctx = { .img = img };
+  make_data(&ctx, D_CLAIMED);
+
+  geo_t *g = &img->geo;
+  uint64_t *blks = NULL, nmark = 0, nfree = 0;
+  char **bufs = NULL;
+  uint nfix = 0, cap = 0;
+  char *buf = malloc(g->bsize);
+  for (uint64_t b = 0; b < img->nbitmapblks; b++) {
+    build_bmp_blk(img, ctx.claimed, b, buf);
+    char *old = blk_ptr(img, img->sb.bmapstart + b);
+    if (memcmp(buf, old, g->bsize) == 0) continue;
+
+    for (uint off = 0; off < g->bsize; off += sizeof(uint64_t)) {
+      uint64_t x, y;
+      memcpy(&x, old + off, sizeof(x));
+      memcpy(&y, buf + off, sizeof(y));
+      nmark += __builtin_popcountll(~x & y);
+      nfree += __builtin_popcountll(x & ~y);
+    }
+    if (dry_run) print_bmp_diff(img, b, old, buf);
+    if (nfix == cap) {
+      cap = cap ? cap * 2 : 64;
+      blks = realloc(blks, cap * sizeof(uint64_t));
+      bufs = realloc(bufs, cap * sizeof(char *));
+    }
+    blks[nfix] = img->sb.bmapstart + b;
+    bufs[nfix++] = buf;
+    buf = malloc(g->bsize);
+  }
+
+  if (nfix == 0) {
+    printf("bitmap is up to date\n");
+  } else {
+    if (!dry_run) write_blks(fd, g->bsize, blks, bufs, nfix);
+    printf("%s %u bitmap block%s, marking %llu and freeing %llu blocks\n",
+           dry_run ? "would rewrite" : "rewrote", nfix, nfix == 1 ? "" : "s",
+           (unsigned long long)nmark, (unsigned long long)nfree);
+  }
+  for (uint k = 0; k < nfix; k++) {
+    free(bufs[k]);
+  }
+  free(bufs);
+  free(blks);
+  free(buf);
+}
+
+// Get a block for writing: its copy staged in the overlay, made from the image the first
+// time the block is staged
+char *stage_blk(img_t *img, uint64_t addr) {
+  char *data = img->novl ? ovl_find(img, addr) : NULL;
+  if (data == NULL) {
+    data = malloc(img->geo.bsize);
+    memcpy(data, blk_ptr(img, addr), img->geo.bsize);
+    ovl_put(img, addr, data);
+  }
+  return data;
+}
 
-  free(chk_blks);
+// Get an inode for writing, staging its block
+struct dinode *stage_inode(img_t *img, uint inum) {
+  geo_t *g = &img->geo;
+  return (struct dinode *)(stage_blk(img, img->sb.inodestart + inum / g->ipb) +
+                           inum % g->ipb * g->isize);
+}
+
+// Get the entry a link points at for writing, staging its directory block
+struct dirent *stage_dirent(img_t *img, link_t *l) {
+  void *addrs = inode_addrs(&img->geo, inode_ptr(img, l->parent));
+  uint64_t addr = map_blk(img, addrs, l->slot / img->geo.dpb);
+  return (struct dirent *)stage_blk(img, addr) + l->slot % img->geo.dpb;
+}
+
+// Find the entry of a directory with the given name, or return false
+bool find_entry(img_t *img, uint dinum, const char *name, link_t *at) {
+  uint64_t n = inode_size(&img->geo, inode_ptr(img, dinum)) / sizeof(struct dirent);
+  for (uint64_t e = 0; e < n; e++) {
+    *at = (link_t){ dinum, e };
+    struct dirent *de = link_dirent(img, at);
+    if (de->inum != 0 && strncmp(de->name, name, DIRSIZ) == 0) return true;
+  }
+  return false;
+}
+
+// Find the first block of the data region at or after from that no inode claims, going
+// by the usage counters, or return 0 if there is none. The old layout's log, at the end
+// of the image, is left out.
+uint64_t unclaimed_blk(img_t *img, uint64_t *claimed, uint64_t from) {
+  uint64_t end = img->sb.logstart == 0 ? img->sb.size - img->sb.nlog : img->sb.size;
+  if (from < img->firstblk) from = img->firstblk;
+  for (uint64_t b = from; b < end; b++) {
+    if (((claimed[b / CNT_PER_WORD] >> (b % CNT_PER_WORD * 2)) & 3) == 0) return b;
+  }
+  return 0;
+}
+
+// Hand out a block no inode claims: count it in the usage counters, mark it in the
+// bitmap and stage it zeroed
+void take_blk(img_t *img, uint64_t *claimed, uint64_t addr) {
+  blk_usage_chk(claimed, addr);
+  char *b = stage_blk(img, img->sb.bmapstart + addr / img->geo.bpb);
+  b[addr % img->geo.bpb / 8] |= bits[addr % 8];
+  memset(stage_blk(img, addr), 0, img->geo.bsize);
+}
+
+// Give the root directory a zeroed block at logical block lblk, taken from those no
+// inode claims, along with the indirect block to hold its address if it has none yet.
+// Only the direct slots and the first indirect block are grown into. Returns false,
+// changing nothing, when lblk lies past those or too few blocks are free.
+bool grow_root(img_t *img, uint64_t *claimed, uint64_t lblk) {
+  geo_t *g = &img->geo;
+  bool direct = lblk < g->ndirect;
+  if (!direct && (g->nlevels == 0 || lblk - g->ndirect >= g->nindirect)) return false;
+  uint64_t ind = direct ? 0 : addr_at(g, inode_addrs(g, inode_ptr(img, ROOTINO)), g->ndirect);
+  uint64_t data = unclaimed_blk(img, claimed, 0);
+  uint64_t newind = !direct && ind == 0 ? unclaimed_blk(img, claimed, data + 1) : 0;
+  if (data == 0 || (!direct && ind == 0 && newind == 0)) return false;
+
+  take_blk(img, claimed, data);
+  void *addrs = inode_addrs(g, stage_inode(img, ROOTINO));
+  if (direct) {
+    set_addr(g, addrs, lblk, data);
+    return true;
+  }
+  if (ind == 0) {
+    take_blk(img, claimed, newind);
+    set_addr(g, addrs, g->ndirect, newind);
+    ind = newind;
+  }
+  set_addr(g, stage_blk(img, ind), lblk - g->ndirect, data);
+  return true;
+}
+
+// Find room for one more entry in the root directory: an unused entry within its size,
+// else the one past its end, which grows its size and, when its last block is full,
+// its block map by a block no inode claims. Returns the entry staged for writing, or
+// NULL when the root cannot grow.
+struct dirent *root_slot(img_t *img, uint64_t *claimed) {
+  geo_t *g = &img->geo;
+  uint64_t size = inode_size(g, inode_ptr(img, ROOTINO));
+  link_t at = { ROOTINO, 0 };
+  for (; at.slot < size / sizeof(struct dirent); at.slot++) {
+    if (link_dirent(img, &at)->inum == 0) return stage_dirent(img, &at);
+  }
+  if (size % g->bsize == 0 && !grow_root(img, claimed, size >> g->bshift)) return NULL;
+  set_inode_size(g, stage_inode(img, ROOTINO), size + sizeof(struct dirent));
+  return stage_dirent(img, &at);
+}
+
+// Link the top of a detached subtree into the root directory as #inum (#inum.k if the
+// name is taken), pointing its '..' at the root if it is a directory. Returns false,
+// changing nothing, when the root cannot grow. Exits, before anything is written, when
+// every such name that fits DIRSIZ is taken.
+bool reconnect(img_t *img, uint64_t *claimed, uint inum, char *name) {
+  link_t at;
+  snprintf(name, DIRSIZ + 1, "#%u", inum);
+  for (uint k = 1; find_entry(img, ROOTINO, name, &at); k++) {
+    if (snprintf(name, DIRSIZ + 1, "#%u.%u", inum, k) > DIRSIZ) {
+      fprintf(stderr, "ERROR: no free name in the root directory for a detached subtree.\n");
+      fprintf(stderr, "  inode %u\n", inum);
+      exit(1);
+    }
+  }
+  struct dirent *de = root_slot(img, claimed);
+  if (de == NULL) return false;
+  memset(de, 0, sizeof(*de));
+  de->inum = inum;
+  memcpy(de->name, name, strlen(name));
+
+  if (inode_ptr(img, inum)->type == T_DIR) {
+    if (find_entry(img, inum, "..", &at)) stage_dirent(img, &at)->inum = ROOTINO;
+    stage_inode(img, ROOTINO)->nlink++;
+  }
+  return true;
+}
+
+// Entries counted per inode in the directories of subtrees left detached
+typedef struct {
+  img_t *img;
+  int *held;
+} held_t;
+
+// Count the entries of one block of a detached directory, but for '.' and '..'
+void count_held(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  held_t *h = arg;
+  if (map_lblk(&h->img->geo, slot, level, pos) < 0) return;
+  struct dirent *de = (struct dirent *)blk_ptr(h->img, addr);
+  for (uint j = 0; j < h->img->geo.dpb; j++, de++) {
+    if (de->inum == 0 || de->inum >= h->img->sb.ninodes) continue;
+    if (strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) continue;
+    h->held[de->inum]++;
+  }
+}
+
+// Order overlaid blocks by block number
+int cmp_ovl(const void *a, const void *b) {
+  const ovl_t *x = a, *y = b;
+  return x->blk < y->blk ? -1 : x->blk > y->blk;
+}
+
+// Write the undo journal of a repair and flush it to disk: the header, the n block
+// numbers, then the contents of those blocks in the image before the repair
+void write_journal(img_t *img, const char *path, uint64_t *blks, uint n) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    perror(path);
+    fprintf(stderr, "  an existing undo journal is never overwritten; revert or remove it first\n");
+    exit(1);
+  }
+  FILE *f = fdopen(fd, "w");
+  setvbuf(f, NULL, _IOFBF, 1 << 20);
+  undo_hdr_t hdr = { UNDO_MAGIC, img->geo.bsize, n };
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(blks, sizeof(uint64_t), n, f);
+  for (uint k = 0; k < n; k++) {
+    fwrite(img->map + ((size_t)blks[k] << img->geo.bshift), img->geo.bsize, 1, f);
+  }
+  if (fflush(f) != 0 || ferror(f) || fsync(fd) != 0) {
+    perror(path);
+    exit(1);
+  }
+  fclose(f);
+}
+
+// Repair what the directory checks find: link each detached subtree into the root as
+// #inum (or leave it in place, when the root cannot grow or the subtree is a cycle),
+// clear entries naming free inodes, and set the link count of every file to the entries
+// naming it. Changes are staged in the overlay, so the second walk, which finds the
+// entries to clear and counts links, sees the subtrees reconnected. The blocks they
+// touch are saved to the undo journal, then written in ascending order, one pwritev per
+// run of adjacent blocks. With dry_run the repairs are only printed. Like a bitmap
+// rebuild, a repair needs block maps that pass the address checks and no pending log
+// transaction; since the root may grow into blocks no inode claims, no block may be
+// claimed twice.
+void repair(img_t *img, int fd, const char *journal, bool dry_run) {
+  if (img->novl) {
+    fprintf(stderr, "ERROR: log transaction pending.\n");
+    fprintf(stderr, "  boot the image or replay its log before repairing it\n");
+    exit(1);
+  }
+  ctx_t ctx = { .img = img };
+  make_data(&ctx, D_CLAIMED | D_REFS);
+  if (ctx.dup_type) {
+    fprintf(stderr, "ERROR: %s address used more than once.\n", ctx.dup_type);
+    fprintf(stderr, "  repairs free blocks, so every block must have one owner\n");
+    exit(1);
+  }
+
+  uint n = img->sb.ninodes, nfix = 0, ngrps;
+  uint *uf = malloc(n * sizeof(uint));
+  orphan_grp_t *grps = orphan_groups(img, &ctx.refs, uf, &ngrps);
+  for (uint k = 0; k < ngrps; k++) {
+    char name[DIRSIZ + 1];
+    if (!grps[k].cycle && reconnect(img, ctx.claimed, grps[k].top, name)) {
+      printf("reconnected detached subtree at inode %u as /%s\n", grps[k].top, name);
+      nfix++;
+    } else {
+      printf("left detached subtree at inode %u in place: %s\n", grps[k].top,
+             grps[k].cycle ? "its directories form a cycle" : "the root directory cannot grow");
+    }
+  }
+  free(uf);
+  free(grps);
+
+  // Walk again over the staged image, which reaches the reconnected subtrees
+  ctx_t after = { .img = img };
+  make_data(&after, D_ALLOC | D_REFS);
+  refs_t *refs = &after.refs;
+  cols_t *c = &after.cols;
+  for (uint i = 2; i < n; i++) {
+    if (refs->inmap[i] == 0 || c->type[i] != 0) continue;
+    for (uint k = 0; k <= refs->nextra; k++) {
+      if (k > 0 && refs->extra[k - 1].inum != i) continue;
+      link_t *l = k == 0 ? &refs->links[i] : &refs->extra[k - 1].at;
+      struct dirent *de = stage_dirent(img, l);
+      printf("cleared entry '%.*s' of directory %u: inode %u is free\n", DIRSIZ, de->name,
+             l->parent, i);
+      memset(de, 0, sizeof(*de));
+      nfix++;
+    }
+  }
+  // Subtrees left in place are not reached, but their entries still count as links.
+  // An inode no entry names at all is left detached as it is.
+  held_t h = { img, calloc(n, sizeof(int)) };
+  for (uint i = 2; i < n; i++) {
+    if (c->type[i] != T_DIR || refs->inmap[i] != 0) continue;
+    walk_map(img, inode_addrs(&img->geo, inode_ptr(img, i)), count_held, &h);
+  }
+  for (uint i = 2; i < n; i++) {
+    int want = refs->inmap[i] + h.held[i];
+    if (c->type[i] != T_FILE || want == 0 || c->nlink[i] == want) continue;
+    printf("inode %u: nlink %d -> %d\n", i, c->nlink[i], want);
+    stage_inode(img, i)->nlink = want;
+    nfix++;
+  }
+  free(h.held);
+
+  if (nfix == 0) {
+    printf("nothing to repair\n");
+    return;
+  }
+  ovl_t *staged = malloc(img->novl * sizeof(ovl_t));
+  uint nblks = 0;
+  for (uint h = 0; h <= ~0u >> img->ovl_shift; h++) {
+    if (img->ovl[h].blk != 0) staged[nblks++] = img->ovl[h];
+  }
+  qsort(staged, nblks, sizeof(ovl_t), cmp_ovl);
+  uint64_t *blks = malloc(nblks * sizeof(uint64_t));
+  char **bufs = malloc(nblks * sizeof(char *));
+  for (uint k = 0; k < nblks; k++) {
+    blks[k] = staged[k].blk;
+    bufs[k] = staged[k].data;
+  }
+
+  if (dry_run) {
+    printf("would repair %u problem%s, writing %u block%s\n", nfix, nfix == 1 ? "" : "s",
+           nblks, nblks == 1 ? "" : "s");
+  } else {
+    write_journal(img, journal, blks, nblks);
+    write_blks(fd, img->geo.bsize, blks, bufs, nblks);
+    printf("repaired %u problem%s, writing %u block%s; undo journal in %s\n", nfix,
+           nfix == 1 ? "" : "s", nblks, nblks == 1 ? "" : "s", journal);
+  }
+  for (uint k = 0; k < nblks; k++) {
+    free(bufs[k]);
+  }
+  free(staged);
+  free(blks);
+  free(bufs);
+}
+
+// Revert a repair by writing back the blocks its undo journal saved, in the same sorted
+// runs the repair wrote them in: fcheck undo <image> [<journal>], the journal defaulting
+// to the image's name followed by .undo
+int undo_main(int argc, char *argv[]) {
+  char path[4096];
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: fcheck undo <file_system_image> [<undo_journal>]\n");
+    exit(1);
+  }
+  const char *journal = argv[2];
+  if (argc == 2) {
+    snprintf(path, sizeof(path), "%s.undo", argv[1]);
+    journal = path;
+  }
+
+  int jfd = open(journal, O_RDONLY);
+  struct stat st;
+  if (jfd < 0 || fstat(jfd, &st) < 0) {
+    perror(journal);
+    exit(1);
+  }
+  undo_hdr_t *hdr = st.st_size >= (off_t)sizeof(undo_hdr_t)
+                        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, jfd, 0)
+                        : MAP_FAILED;
+  if (hdr == MAP_FAILED || memcmp(hdr->magic, UNDO_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->bsize < 512 || hdr->bsize > 65536 || (hdr->bsize & (hdr->bsize - 1)) != 0 ||
+      hdr->nblks > (uint64_t)st.st_size / (hdr->bsize + sizeof(uint64_t)) ||
+      st.st_size != (off_t)(sizeof(*hdr) + hdr->nblks * (hdr->bsize + sizeof(uint64_t)))) {
+    fprintf(stderr, "ERROR: bad undo journal.\n");
+    exit(1);
+  }
+
+  int fd = open(argv[1], O_RDWR);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(argv[1]);
+    exit(1);
+  }
+  uint n = hdr->nblks;
+  uint64_t *blks = (uint64_t *)(hdr + 1);
+  char **bufs = malloc(n * sizeof(char *));
+  for (uint k = 0; k < n; k++) {
+    if ((k > 0 && blks[k] <= blks[k - 1]) || blks[k] >= (uint64_t)st.st_size / hdr->bsize) {
+      fprintf(stderr, "ERROR: bad undo journal.\n");
+      fprintf(stderr, "  block %llu is out of order or past the end of the image\n",
+              (unsigned long long)blks[k]);
+      exit(1);
+    }
+    bufs[k] = (char *)(blks + n) + (size_t)k * hdr->bsize;
+  }
+  write_blks(fd, hdr->bsize, blks, bufs, n);
+  printf("restored %u block%s from %s\n", n, n == 1 ? "" : "s", journal);
+  free(bufs);
+  return 0;
+}
+
+// Parse a --bsize, --ndirect or --levels option of a tool at argv[*a], storing its value
+// in forced[0], [1] or [2] and stepping past it. Returns false for any other argument.
+bool geo_opt(int argc, char *argv[], int *a, uint *forced) {
+  static const char *names[] = { "--bsize", "--ndirect", "--levels" };
+  for (uint k = 0; k < 3; k++) {
+    if (*a + 1 < argc && strcmp(argv[*a], names[k]) == 0) {
+      forced[k] = strtoul(argv[++*a], NULL, 0);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Find an inode given by number, or by path from the root directory, in an image whose
+// block maps are validated. Returns 0 if there is no such inode.
+uint lookup(img_t *img, const char *spec) {
+  char *end;
+  unsigned long inum = strtoul(spec, &end, 10);
+  if (*spec >= '0' && *spec <= '9' && *end == '\0') return inum < img->sb.ninodes ? inum : 0;
+
+  uint cur = ROOTINO;
+  while (*spec != '\0') {
+    size_t len = strcspn(spec, "/");
+    if (len > 0) {
+      char name[DIRSIZ + 1];
+      link_t at;
+      if (len > DIRSIZ || inode_ptr(img, cur)->type != T_DIR) return 0;
+      memcpy(name, spec, len);
+      name[len] = '\0';
+      if (!find_entry(img, cur, name, &at)) return 0;
+      cur = link_dirent(img, &at)->inum;
+      if (cur >= img->sb.ninodes) return 0;
+    }
+    spec += len + (spec[len] == '/');
+  }
+  return cur;
+}
+
+// File being extracted, and the run of its blocks being gathered: blocks adjacent both
+// in the file and in the image file
+typedef struct {
+  img_t *img;
+  int in, out;
+  uint64_t size;
+  uint64_t nblks; // Logical blocks within size
+  uint64_t lblk;  // First block of the run
+  off_t src;      // Its offset in the image file
+  uint64_t n;     // Blocks in the run, 0 when there is none
+  uint runs;
+} extract_t;
+
+// Copy the run of blocks gathered, trimmed to the file's size, from the image file to
+// the same offset of the output in one copy_file_range, so the kernel moves the data
+// without a copy through user space. Where the two files cannot share a copy, sendfile
+// does the rest from the output's position.
+void copy_run(extract_t *e) {
+  if (e->n == 0) return;
+  uint64_t start = e->lblk << e->img->geo.bshift, len = e->n << e->img->geo.bshift;
+  if (len > e->size - start) len = e->size - start;
+  loff_t in = e->src, out = start;
+  while (len > 0) {
+    ssize_t r = copy_file_range(e->in, &in, e->out, &out, len, 0);
+    if (r < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      off_t pos = in;
+      if (lseek(e->out, out, SEEK_SET) < 0) {
+        perror("lseek");
+        exit(1);
+      }
+      r = sendfile(e->out, e->in, &pos, len);
+      if (r > 0) out += r;
+      in = pos;
+    }
+    if (r <= 0) {
+      perror("copy_file_range");
+      exit(1);
+    }
+    len -= r;
+  }
+  e->runs++;
+  e->n = 0;
+}
+
+// Add a data block of the file to the run being gathered, copying the run first if the
+// block does not extend it. Blocks are served from the log when a replayed transaction
+// wrote them, which only changes where they are read from.
+void extract_blk(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  extract_t *e = arg;
+  int64_t lblk = map_lblk(&e->img->geo, slot, level, pos);
+  if (lblk < 0 || (uint64_t)lblk >= e->nblks) return;
+  off_t src = blk_ptr(e->img, addr) - e->img->map;
+  if (e->n > 0 && (uint64_t)lblk == e->lblk + e->n &&
+      src == e->src + (off_t)(e->n << e->img->geo.bshift)) {
+    e->n++;
+    return;
+  }
+  copy_run(e);
+  *e = (extract_t){ e->img, e->in, e->out, e->size, e->nblks, lblk, src, 1, e->runs };
+}
+
+// Copy a file out of an image: fcheck extract <image> <inum|path> <out>. Its block map is
+// walked, and every run of blocks adjacent in the file and the image is copied by the
+// kernel in one call. Unmapped blocks are left as holes, and the output is then
+// truncated to the file's size, which makes any trailing hole.
+int extract_main(int argc, char *argv[]) {
+  uint forced[3] = { 0, 0, 0 };
+  char *args[3];
+  int nargs = 0;
+  for (int a = 1; a < argc; a++) {
+    if (geo_opt(argc, argv, &a, forced)) continue;
+    if (argv[a][0] == '-' || nargs == 3) {
+      nargs = 0;
+      break;
+    }
+    args[nargs++] = argv[a];
+  }
+  if (nargs != 3) {
+    fprintf(stderr, "Usage: fcheck extract [--bsize <n>] [--ndirect <n>] [--levels <n>] "
+            "<file_system_image> <inum|path> <out>\n");
+    exit(1);
+  }
+
+  img_t img;
+  int fd = open_img(&img, args[0], O_RDONLY, forced[0], forced[1], forced[2]);
+  ctx_t ctx = { .img = &img };
+  make_data(&ctx, D_DIRECT | D_INDIRECT);
+  uint inum = lookup(&img, args[1]);
+  struct dinode *in = inode_ptr(&img, inum);
+  if (inum == 0 || (in->type != T_FILE && in->type != T_DIR)) {
+    fprintf(stderr, "ERROR: %s is not a file or directory in the image.\n", args[1]);
+    exit(1);
+  }
+
+  int out = open(args[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror(args[2]);
+    exit(1);
+  }
+  uint64_t size = inode_size(&img.geo, in), nblks = size_blks(&img.geo, size);
+  extract_t e = { .img = &img, .in = fd, .out = out, .size = size,
+                  .nblks = nblks < img.geo.maxblks ? nblks : img.geo.maxblks };
+  walk_map(&img, inode_addrs(&img.geo, in), extract_blk, &e);
+  copy_run(&e);
+  if (ftruncate(out, size) != 0 || close(out) != 0) {
+    perror(args[2]);
+    exit(1);
+  }
+  printf("extracted inode %u: %llu bytes in %u run%s\n", inum, (unsigned long long)size, e.runs,
+         e.runs == 1 ? "" : "s");
+  return 0;
+}
+
+// Directory whose subtree du reports: its inode and the totals below it
+typedef struct {
+  uint inum;
+  uint inodes;
+  uint64_t blocks;
+} du_dir_t;
+
+// Order directories by blocks held, heaviest first, then by inode
+int cmp_du_dir(const void *a, const void *b) {
+  const du_dir_t *x = a, *y = b;
+  if (x->blocks != y->blocks) return x->blocks > y->blocks ? -1 : 1;
+  return x->inum < y->inum ? -1 : x->inum > y->inum;
+}
+
+// Report the space each directory's subtree holds: fcheck du [--top <n>] <image>. Every
+// inode's blocks, data and indirect, follow from its size as for the bitmap count, so
+// no block map is read past the directory walk. The walk lists inodes parents first,
+// so going through that list backwards adds each one into the directory it was first
+// found in after everything below it: a post-order accumulation in one pass. A file
+// with several links counts once, under its first. The n heaviest subtrees are printed.
+int du_main(int argc, char *argv[]) {
+  uint forced[3] = { 0, 0, 0 }, top = 10;
+  char *fname = NULL;
+  for (int a = 1; a < argc; a++) {
+    if (geo_opt(argc, argv, &a, forced)) continue;
+    if (a + 1 < argc && strcmp(argv[a], "--top") == 0) {
+      top = strtoul(argv[++a], NULL, 0);
+    } else if (argv[a][0] != '-' && fname == NULL) {
+      fname = argv[a];
+    } else {
+      fname = NULL;
+      break;
+    }
+  }
+  if (fname == NULL) {
+    fprintf(stderr, "Usage: fcheck du [--top <n>] [--bsize <n>] [--ndirect <n>] [--levels <n>] "
+            "<file_system_image>\n");
+    exit(1);
+  }
+
+  img_t img;
+  open_img(&img, fname, O_RDONLY, forced[0], forced[1], forced[2]);
+  ctx_t ctx = { .img = &img };
+  make_data(&ctx, D_ALLOC | D_REFS);
+  geo_t *g = &img.geo;
+  cols_t *c = &ctx.cols;
+  refs_t *refs = &ctx.refs;
+  uint n = img.sb.ninodes, lost = 0;
+  uint64_t lostblks = 0;
+  uint64_t *blocks = malloc(n * sizeof(uint64_t));
+  uint *inodes = malloc(n * sizeof(uint));
+  for (uint i = 0; i < n; i++) {
+    uint64_t nblks = (c->type[i] == T_FILE || c->type[i] == T_DIR) * size_blks(g, c->size[i]);
+    blocks[i] = nblks + ind_blks(g, nblks);
+    inodes[i] = c->type[i] != 0;
+    if (i >= 2 && inodes[i] && refs->inmap[i] == 0) {
+      lost++;
+      lostblks += blocks[i];
+    }
+  }
+  for (uint k = refs->norder; k-- > 0; ) {
+    uint i = refs->order[k], p = refs->links[i].parent;
+    blocks[p] += blocks[i];
+    inodes[p] += inodes[i];
+  }
+
+  du_dir_t *dirs = malloc(n * sizeof(du_dir_t));
+  uint ndirs = 0;
+  for (uint i = ROOTINO; i < n; i++) {
+    if (c->type[i] == T_DIR && (i == ROOTINO || refs->inmap[i] > 0)) {
+      dirs[ndirs++] = (du_dir_t){ i, inodes[i], blocks[i] };
+    }
+  }
+  qsort(dirs, ndirs, sizeof(du_dir_t), cmp_du_dir);
+
+  printf("%llu blocks of %u bytes in %u inodes reachable from the root",
+         (unsigned long long)blocks[ROOTINO], g->bsize, inodes[ROOTINO]);
+  if (lost > 0) printf("; %u detached inodes hold %llu more", lost, (unsigned long long)lostblks);
+  printf("\n%12s %10s  %s\n", "blocks", "inodes", "directory");
+  for (uint k = 0; k < ndirs && k < top; k++) {
+    printf("%12llu %10u  ", (unsigned long long)dirs[k].blocks, dirs[k].inodes);
+    if (dirs[k].inum == ROOTINO) {
+      printf("/");
+    } else {
+      put_path(stdout, &img, refs, &refs->links[dirs[k].inum]);
+    }
+    printf("\n");
+  }
+  free(blocks);
+  free(inodes);
+  free(dirs);
+  return 0;
+}
+
+// Block of the window being compacted that is read from the input image
+typedef struct {
+  char *src;
+  uint slot;
+} compact_src_t;
+
+// Output of fcheck compact: a window of blocks adjacent in the output, from next - n to
+// next, and those of them still to be read from the input
+typedef struct {
+  img_t *img;
+  int fd;
+  uint64_t next; // Block the next one laid out goes to
+  char *buf;
+  uint n, cap;
+  compact_src_t *srcs;
+  uint nsrcs;
+  char *itab;    // Copy of the inode table, pointed at the new blocks
+} compact_t;
+
+// Order window blocks by where they are read from
+int cmp_compact_src(const void *a, const void *b) {
+  const compact_src_t *x = a, *y = b;
+  return x->src < y->src ? -1 : x->src > y->src;
+}
+
+// Fill in the window's blocks from the input, in ascending input order, and write it
+// out in one pwrite
+void compact_flush(compact_t *c) {
+  uint bsize = c->img->geo.bsize;
+  qsort(c->srcs, c->nsrcs, sizeof(compact_src_t), cmp_compact_src);
+  for (uint k = 0; k < c->nsrcs; k++) {
+    memcpy(c->buf + (size_t)c->srcs[k].slot * bsize, c->srcs[k].src, bsize);
+  }
+  ssize_t len = (ssize_t)c->n * bsize;
+  if (pwrite(c->fd, c->buf, len, (off_t)((c->next - c->n) * bsize)) != len) {
+    perror("pwrite");
+    exit(1);
+  }
+  c->n = c->nsrcs = 0;
+}
+
+// Lay out a block built in place at the next output block. Returns it zeroed, valid
+// until the next block is laid out.
+char *compact_new(compact_t *c) {
+  if (c->n == c->cap) compact_flush(c);
+  char *blk = c->buf + ((size_t)c->n << c->img->geo.bshift);
+  memset(blk, 0, c->img->geo.bsize);
+  c->n++;
+  c->next++;
+  return blk;
+}
+
+// Lay out a copy of block addr of the input at the next output block
+void compact_copy(compact_t *c, uint64_t addr) {
+  if (c->n == c->cap) compact_flush(c);
+  c->srcs[c->nsrcs++] = (compact_src_t){ blk_ptr(c->img, addr), c->n };
+  c->n++;
+  c->next++;
+}
+
+// Lay out the tree under indirect block addr, whose entries are level levels below
+// addrs[slot], in the order walk_tblk() visits it: the block first, then each entry
+// followed by the tree below it. The block's new entries are known before anything
+// below it is laid out from the sizes of the trees under them.
+void compact_tree(compact_t *c, uint64_t addr, uint slot, uint level, uint64_t blkpos) {
+  geo_t *g = &c->img->geo;
+  void *ind = blk_ptr(c->img, addr);
+  bool leaf = level == slot - g->ndirect + 1;
+  void *out = compact_new(c);
+  uint64_t at = c->next;
+  for (uint i = 0; i < g->nindirect; i++) {
+    uint64_t a = addr_at(g, ind, i), pos = blkpos * g->nindirect + i;
+    if (a == 0) continue;
+    set_addr(g, out, i, at++);
+    if (!leaf && map_reachable(g, slot, level, pos)) {
+      walk_tblk(c->img, a, slot, level + 1, pos, count_blk, &at);
+    }
+  }
+  for (uint i = 0; i < g->nindirect; i++) {
+    uint64_t a = addr_at(g, ind, i), pos = blkpos * g->nindirect + i;
+    if (a == 0) continue;
+    if (!leaf && map_reachable(g, slot, level, pos)) {
+      compact_tree(c, a, slot, level + 1, pos);
+    } else {
+      compact_copy(c, a);
+    }
+  }
+}
+
+// Lay out an inode's blocks from the next output block on, in walk_map() order, and
+// point its copy in the new inode table at them
+void compact_inode(compact_t *c, uint inum) {
+  geo_t *g = &c->img->geo;
+  void *addrs = inode_addrs(g, inode_ptr(c->img, inum));
+  void *to = inode_addrs(g, (struct dinode *)(c->itab + ((size_t)(inum / g->ipb) << g->bshift) +
+                                              inum % g->ipb * g->isize));
+  for (uint s = 0; s < g->ndirect + g->nlevels; s++) {
+    uint64_t a = addr_at(g, addrs, s);
+    if (a == 0) continue;
+    set_addr(g, to, s, c->next);
+    if (s < g->ndirect) {
+      compact_copy(c, a);
+    } else {
+      compact_tree(c, a, s, 1, 0);
+    }
+  }
+}
+
+// Build bitmap block b of the compacted image, in which exactly the blocks below end
+// are in use. Bits past size are kept as they are.
+void compact_bmp_blk(img_t *img, uint64_t end, uint64_t b, char *out) {
+  geo_t *g = &img->geo;
+  memcpy(out, blk_ptr(img, img->sb.bmapstart + b), g->bsize);
+  for (uint j = 0; j < g->bsize; j++) {
+    uint64_t blk = b * g->bpb + (uint64_t)j * 8;
+    if (blk + 8 <= end) {
+      out[j] = 0xff;
+    } else if (blk >= end && blk + 8 <= img->sb.size) {
+      out[j] = 0;
+    } else {
+      for (uint i = 0; i < 8 && blk + i < img->sb.size; i++) {
+        out[j] = blk + i < end ? out[j] | bits[i] : out[j] & ~bits[i];
+      }
+    }
+  }
+}
+
+// Rewrite an image with every inode's blocks contiguous: fcheck compact <in> <out>. The
+// input must pass the full check. Directories come first after the metadata, in the
+// order the directory walk found them, then the other inodes in that same order, so a
+// directory's files lie side by side. Each inode's blocks follow walk_map() order,
+// every indirect block just ahead of the blocks it points to. The output is written
+// front to back in windows of COMPACT_WINDOW bytes, each filled from the input in
+// ascending input order, the data region first and the metadata last. Inode numbers,
+// the superblock and free inodes are kept; the log is left empty, since a pending
+// transaction has been replayed into what is copied, and free blocks are holes.
+int compact_main(int argc, char *argv[]) {
+  uint forced[3] = { 0, 0, 0 };
+  char *args[2];
+  int nargs = 0;
+  for (int a = 1; a < argc; a++) {
+    if (geo_opt(argc, argv, &a, forced)) continue;
+    if (argv[a][0] == '-' || nargs == 2) {
+      nargs = 0;
+      break;
+    }
+    args[nargs++] = argv[a];
+  }
+  if (nargs != 2) {
+    fprintf(stderr, "Usage: fcheck compact [--bsize <n>] [--ndirect <n>] [--levels <n>] "
+            "<file_system_image> <out>\n");
+    exit(1);
+  }
+
+  img_t img;
+  int fd = open_img(&img, args[0], O_RDONLY, forced[0], forced[1], forced[2]);
+  struct stat ist, ost;
+  if (fstat(fd, &ist) == 0 && stat(args[1], &ost) == 0 && ist.st_dev == ost.st_dev &&
+      ist.st_ino == ost.st_ino) {
+    fprintf(stderr, "ERROR: output is the input image.\n");
+    exit(1);
+  }
+  ctx_t ctx = { .img = &img };
+  run_checks(&ctx, TIER_FULL, D_ALLOC | D_REFS, false);
+
+  int out = open(args[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0 || ftruncate(out, img.len) != 0) {
+    perror(args[1]);
+    exit(1);
+  }
+  geo_t *g = &img.geo;
+  sb_t *sb = &img.sb;
+  compact_t c = { .img = &img, .fd = out, .next = img.firstblk };
+  c.cap = COMPACT_WINDOW >> g->bshift;
+  c.buf = malloc(COMPACT_WINDOW);
+  c.srcs = malloc(c.cap * sizeof(compact_src_t));
+  c.itab = malloc((size_t)img.ninodeblks << g->bshift);
+  for (uint b = 0; b < img.ninodeblks; b++) {
+    memcpy(c.itab + ((size_t)b << g->bshift), blk_ptr(&img, sb->inodestart + b), g->bsize);
+  }
+
+  // Directories, then everything else, each in the order the walk found them
+  refs_t *refs = &ctx.refs;
+  compact_inode(&c, ROOTINO);
+  for (uint k = 0; k < refs->norder; k++) {
+    if (ctx.cols.type[refs->order[k]] == T_DIR) compact_inode(&c, refs->order[k]);
+  }
+  for (uint k = 0; k < refs->norder; k++) {
+    if (ctx.cols.type[refs->order[k]] != T_DIR) compact_inode(&c, refs->order[k]);
+  }
+  compact_flush(&c);
+
+  // Then the metadata: the superblock, an empty log, the new inode table and bitmap
+  uint64_t end = c.next;
+  c.next = 0;
+  for (uint64_t b = 0; b < img.firstblk; b++) {
+    if (b >= sb->inodestart && b < sb->inodestart + img.ninodeblks) {
+      memcpy(compact_new(&c), c.itab + ((b - sb->inodestart) << g->bshift), g->bsize);
+    } else if (b >= sb->bmapstart && b < sb->bmapstart + img.nbitmapblks) {
+      compact_bmp_blk(&img, end, b - sb->bmapstart, compact_new(&c));
+    } else if (sb->logstart != 0 && b >= sb->logstart && b < sb->logstart + sb->nlog) {
+      compact_new(&c);
+    } else {
+      compact_copy(&c, b);
+    }
+  }
+  compact_flush(&c);
+  if (fdatasync(out) != 0 || close(out) != 0) {
+    perror(args[1]);
+    exit(1);
+  }
+  printf("compacted %u inodes into blocks %llu to %llu of %s\n", refs->norder + 1,
+         (unsigned long long)img.firstblk, (unsigned long long)end - 1, args[1]);
+  free(c.buf);
+  free(c.srcs);
+  free(c.itab);
+  return 0;
+}
+
+// Header of a block ownership index, written by --index and read by fcheck query. The
+// tables follow it at the offsets given, each entry a fixed-size record, so a query maps
+// the file and indexes them directly.
+typedef struct {
+  char magic[8];      // INDEX_MAGIC
+  uint64_t digest;    // image_digest() of the image it was built from
+  int64_t isize;      // Size and modification time of the image file then
+  int64_t mtime, mtime_ns;
+  sb_t sb;
+  uint64_t firstblk, ninodeblks, nbitmapblks;
+  uint64_t nexts, nlinks;
+  uint64_t exts;      // idx_ext_t per extent of blocks in use, in block order
+  uint64_t inodes;    // idx_inode_t per inode
+  uint64_t links;     // idx_link_t per directory entry, grouped by directory
+} index_hdr_t;
+
+// Extent of blocks in use in the index: n blocks from blk on, held by inode inum. A data
+// extent, of height 0, holds consecutive logical blocks from lblk. An indirect block is
+// an extent of its own, height levels above the data and covering logical blocks from
+// lblk.
+typedef struct {
+  uint64_t blk;
+  uint64_t n;
+  uint64_t lblk;
+  uint inum;
+  uint height;
+} idx_ext_t;
+
+// Order extents by block
+int cmp_idx_ext(const void *a, const void *b) {
+  const idx_ext_t *x = a, *y = b;
+  return x->blk < y->blk ? -1 : x->blk > y->blk;
+}
+
+// Inode in the index: its fields, its first link and, for a directory, the range of the
+// links table holding its entries
+typedef struct {
+  short type;
+  short nlink;
+  uint nents;
+  uint64_t size;
+  uint64_t link; // First link naming the inode, ~0 if none
+  uint64_t ents;
+} idx_inode_t;
+
+// Directory entry in the index, with the next link naming the same inode, ~0 if none
+typedef struct {
+  uint parent;
+  uint inum;
+  uint64_t next;
+  char name[DIRSIZ + 2]; // Zero-padded, so always terminated
+} idx_link_t;
+
+// Link of the directory walk, placed in the index in directory then entry order
+typedef struct {
+  uint inum;
+  link_t at;
+  bool first; // The link the walk found the inode through
+} idx_src_t;
+
+// Order links by directory, then by entry
+int cmp_idx_src(const void *a, const void *b) {
+  const idx_src_t *x = a, *y = b;
+  if (x->at.parent != y->at.parent) return x->at.parent < y->at.parent ? -1 : 1;
+  return x->at.slot < y->at.slot ? -1 : x->at.slot > y->at.slot;
+}
+
+// Digest of an image's metadata, built one block at a time
+typedef struct {
+  img_t *img;
+  bool dir;
+  uint64_t sum;
+} digest_t;
+
+// Add a block to the digest. Each block is hashed with its address and the hashes are
+// summed, so blocks may be added in any order.
+void digest_blk(digest_t *d, uint64_t addr) {
+  char *p = blk_ptr(d->img, addr);
+  uint64_t h = addr * 0x9E3779B97F4A7C15ULL;
+  for (uint off = 0; off < d->img->geo.bsize; off += sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, p + off, sizeof(w));
+    h = name_hash(h, w);
+  }
+  d->sum += h;
+}
+
+// Add an inode's indirect blocks to the digest, and a directory's data blocks as well
+void digest_map_blk(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  digest_t *d = arg;
+  if (d->dir || map_lblk(&d->img->geo, slot, level, pos) < 0) digest_blk(d, addr);
+}
+
+// Digest the blocks a block ownership index is built from: the superblock, the inode
+// table, every indirect block and every directory block, as they read after log
+// recovery. Block maps must be validated.
+uint64_t image_digest(ctx_t *ctx) {
+  img_t *img = ctx->img;
+  digest_t d = { img, false, 0 };
+  digest_blk(&d, 1);
+  for (uint b = 0; b < img->ninodeblks; b++) {
+    digest_blk(&d, img->sb.inodestart + b);
+  }
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    d.dir = ctx->cols.type[ctx->alloc[k]] == T_DIR;
+    walk_map(img, inode_addrs(&img->geo, inode_ptr(img, ctx->alloc[k])), digest_map_blk, &d);
+  }
+  return d.sum;
+}
+
+// Extents of the index gathered so far, and the inode whose block map is being walked
+typedef struct {
+  geo_t *geo;
+  idx_ext_t *exts;
+  uint64_t nexts, cap;
+  uint inum;
+} idx_map_t;
+
+// Enter a block map entry into the extents, extending the last one when the entry
+// follows it both on disk and in the file
+void index_blk(void *arg, uint64_t addr, uint slot, uint level, uint64_t pos) {
+  idx_map_t *m = arg;
+  geo_t *g = m->geo;
+  uint k = slot - g->ndirect, height = slot < g->ndirect ? 0 : k + 1 - level;
+  uint64_t lblk = slot < g->ndirect ? slot : g->ndirect + g->base[k] + pos * g->span[height];
+  idx_ext_t *e = m->nexts > 0 ? &m->exts[m->nexts - 1] : NULL;
+  if (e && e->inum == m->inum && e->height == 0 && height == 0 &&
+      e->blk + e->n == addr && e->lblk + e->n == lblk) {
+    e->n++;
+    return;
+  }
+  if (m->nexts == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 1024;
+    m->exts = realloc(m->exts, m->cap * sizeof(idx_ext_t));
+  }
+  m->exts[m->nexts++] = (idx_ext_t){ addr, 1, lblk, m->inum, height };
+}
+
+// Write len bytes of buf at offset off of a file, in as many pwrites as it takes
+void write_at(int fd, const char *path, void *buf, uint64_t len, uint64_t off) {
+  while (len > 0) {
+    ssize_t r = pwrite(fd, buf, len, off);
+    if (r <= 0) {
+      perror(path);
+      exit(1);
+    }
+    buf = (char *)buf + r;
+    len -= r;
+    off += r;
+  }
+}
+
+// Write a block ownership index of a checked image to path, stamped with the image's
+// digest and the size and modification time of its file fd. Blocks in use are entered
+// as extents, as long as the runs of the block maps, so the index grows with the
+// extents of the image rather than its size. Each table is written in one pass, and
+// the file renamed into place once complete.
+void write_index(ctx_t *ctx, int fd, const char *path) {
+  img_t *img = ctx->img;
+  geo_t *g = &img->geo;
+  refs_t *refs = &ctx->refs;
+  uint n = img->sb.ninodes;
+
+  // Every link the walk found, in directory order
+  uint nsrc = 0;
+  idx_src_t *src = malloc(((size_t)n + refs->nextra) * sizeof(idx_src_t));
+  for (uint i = ROOTINO + 1; i < n; i++) {
+    if (refs->inmap[i] > 0) src[nsrc++] = (idx_src_t){ i, refs->links[i], true };
+  }
+  for (uint k = 0; k < refs->nextra; k++) {
+    src[nsrc++] = (idx_src_t){ refs->extra[k].inum, refs->extra[k].at, false };
+  }
+  qsort(src, nsrc, sizeof(idx_src_t), cmp_idx_src);
+
+  // The extents of every block map, in block order
+  idx_map_t m = { .geo = g };
+  for (uint k = 0; k < ctx->nalloc; k++) {
+    m.inum = ctx->alloc[k];
+    walk_map(img, inode_addrs(g, inode_ptr(img, m.inum)), index_blk, &m);
+  }
+  qsort(m.exts, m.nexts, sizeof(idx_ext_t), cmp_idx_ext);
+
+  struct stat st;
+  index_hdr_t hdr = { .magic = INDEX_MAGIC };
+  fstat(fd, &st);
+  hdr.digest = image_digest(ctx);
+  hdr.isize = st.st_size;
+  hdr.mtime = st.st_mtim.tv_sec;
+  hdr.mtime_ns = st.st_mtim.tv_nsec;
+  hdr.sb = img->sb;
+  hdr.firstblk = img->firstblk;
+  hdr.ninodeblks = img->ninodeblks;
+  hdr.nbitmapblks = img->nbitmapblks;
+  hdr.nexts = m.nexts;
+  hdr.nlinks = nsrc;
+  hdr.exts = sizeof(hdr);
+  hdr.inodes = hdr.exts + m.nexts * sizeof(idx_ext_t);
+  hdr.links = hdr.inodes + (uint64_t)n * sizeof(idx_inode_t);
+
+  idx_inode_t *inodes = malloc((size_t)n * sizeof(idx_inode_t));
+  idx_link_t *links = calloc(nsrc, sizeof(idx_link_t));
+  for (uint i = 0; i < n; i++) {
+    struct dinode *in = inode_ptr(img, i);
+    inodes[i] = (idx_inode_t){ in->type, in->nlink, 0, inode_size(g, in), ~0ULL, 0 };
+  }
+
+  // Chain each inode's links backwards, so they come out in directory order after the
+  // one the walk found it through. Following those up from any inode reaches the root.
+  for (uint k = nsrc; k-- > 0; ) {
+    idx_inode_t *dir = &inodes[src[k].at.parent], *in = &inodes[src[k].inum];
+    links[k] = (idx_link_t){ .parent = src[k].at.parent, .inum = src[k].inum, .next = ~0ULL };
+    memcpy(links[k].name, link_dirent(img, &src[k].at)->name, DIRSIZ);
+    if (!src[k].first) {
+      links[k].next = in->link;
+      in->link = k;
+    }
+    dir->ents = k;
+    dir->nents++;
+  }
+  for (uint k = 0; k < nsrc; k++) {
+    if (src[k].first) {
+      links[k].next = inodes[src[k].inum].link;
+      inodes[src[k].inum].link = k;
+    }
+  }
+
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror(tmp);
+    exit(1);
+  }
+  write_at(out, tmp, &hdr, sizeof(hdr), 0);
+  write_at(out, tmp, m.exts, m.nexts * sizeof(idx_ext_t), hdr.exts);
+  write_at(out, tmp, inodes, (uint64_t)n * sizeof(idx_inode_t), hdr.inodes);
+  write_at(out, tmp, links, (uint64_t)nsrc * sizeof(idx_link_t), hdr.links);
+  if (fdatasync(out) != 0 || close(out) != 0 || rename(tmp, path) != 0) {
+    perror(path);
+    exit(1);
+  }
+  free(m.exts);
+  free(inodes);
+  free(links);
+  free(src);
+}
+
+// Block ownership index mapped by fcheck query
+typedef struct {
+  index_hdr_t *hdr;
+  idx_ext_t *exts;
+  idx_inode_t *inodes;
+  idx_link_t *links;
+} index_t;
+
+// Check that an index of len bytes is laid out the way write_index() lays it out, each
+// table right after the one before, and that every inode and link number in it is in
+// range, so that queries stay within the mapping
+bool idx_valid(index_t *x, uint64_t len) {
+  index_hdr_t *h = x->hdr;
+  uint64_t n = h->sb.ninodes, nlinks = h->nlinks;
+  if (n <= ROOTINO || n > len / sizeof(idx_inode_t) || h->nexts > len / sizeof(idx_ext_t) ||
+      nlinks > len / sizeof(idx_link_t)) {
+    return false;
+  }
+  if (h->exts != sizeof(*h) || h->inodes != h->exts + h->nexts * sizeof(idx_ext_t) ||
+      h->links != h->inodes + n * sizeof(idx_inode_t) ||
+      len != h->links + nlinks * sizeof(idx_link_t) ||
+      (h->exts | h->inodes | h->links) % sizeof(uint64_t) != 0) {
+    return false;
+  }
+  x->exts = (idx_ext_t *)((char *)h + h->exts);
+  x->inodes = (idx_inode_t *)((char *)h + h->inodes);
+  x->links = (idx_link_t *)((char *)h + h->links);
+
+  for (uint64_t k = 0; k < h->nexts; k++) {
+    if (x->exts[k].inum >= n) return false;
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    idx_inode_t *in = &x->inodes[i];
+    if ((in->link != ~0ULL && in->link >= nlinks) || in->ents > nlinks ||
+        in->nents > nlinks - in->ents) {
+      return false;
+    }
+  }
+  for (uint64_t k = 0; k < nlinks; k++) {
+    idx_link_t *l = &x->links[k];
+    if (l->parent >= n || l->inum >= n || (l->next != ~0ULL && l->next >= nlinks) ||
+        l->name[DIRSIZ + 1] != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Give up on an index whose links loop, which only a corrupt one can
+void idx_loop(uint64_t link) {
+  fprintf(stderr, "ERROR: links of the index form a loop.\n");
+  fprintf(stderr, "  link %llu\n", (unsigned long long)link);
+  exit(1);
+}
+
+// Get the link naming the parent directory of a link, or ~0 once the root is reached
+uint64_t idx_up(index_t *x, uint64_t link) {
+  uint parent = x->links[link].parent;
+  return parent == ROOTINO ? ~0ULL : x->inodes[parent].link;
+}
+
+// Print the path of an index link from the root. The names are laid into a buffer from
+// its end while walking up the parents, at most as many as there are inodes.
+void idx_put_path(index_t *x, uint64_t link) {
+  uint64_t len = 0, depth = 0;
+  for (uint64_t k = link; k != ~0ULL; k = idx_up(x, k)) {
+    if (++depth > x->hdr->sb.ninodes) idx_loop(link);
+    len += 1 + strlen(x->links[k].name);
+  }
+  char *buf = malloc(len + 1), *p = buf + len;
+  *p = '\0';
+  for (uint64_t k = link; k != ~0ULL; k = idx_up(x, k)) {
+    size_t n = strlen(x->links[k].name);
+    p -= n;
+    memcpy(p, x->links[k].name, n);
+    *--p = '/';
+  }
+  fputs(buf, stdout);
+  free(buf);
+}
+
+// Print every path of an inode in the index, one per line after the given prefix
+void idx_put_paths(index_t *x, uint inum, const char *prefix) {
+  if (inum == ROOTINO) printf("%s/\n", prefix);
+  if (inum != ROOTINO && x->inodes[inum].link == ~0ULL) printf("%sno path\n", prefix);
+  uint64_t n = 0;
+  for (uint64_t k = x->inodes[inum].link; k != ~0ULL; k = x->links[k].next) {
+    if (++n > x->hdr->nlinks) idx_loop(x->inodes[inum].link);
+    printf("%s", prefix);
+    idx_put_path(x, k);
+    printf("\n");
+  }
+}
+
+// Find an inode given by number, or by path from the root, in the index. Returns 0 if
+// there is no such inode.
+uint idx_lookup(index_t *x, const char *spec) {
+  char *end;
+  unsigned long inum = strtoul(spec, &end, 10);
+  if (*spec >= '0' && *spec <= '9' && *end == '\0') return inum < x->hdr->sb.ninodes ? inum : 0;
+
+  uint cur = ROOTINO;
+  while (*spec != '\0') {
+    size_t len = strcspn(spec, "/");
+    if (len > DIRSIZ) return 0;
+    if (len > 0) {
+      idx_inode_t *dir = &x->inodes[cur];
+      uint64_t k = dir->ents, e = dir->ents + dir->nents;
+      while (k < e && (strncmp(x->links[k].name, spec, len) != 0 || x->links[k].name[len] != '\0')) {
+        k++;
+      }
+      if (k == e) return 0;
+      cur = x->links[k].inum;
+    }
+    spec += len + (spec[len] == '/');
+  }
+  return cur;
+}
+
+// Find the extent of the index holding a block, by binary search, or NULL if the block
+// is not in use
+idx_ext_t *idx_find_ext(index_t *x, uint64_t addr) {
+  uint64_t lo = 0, hi = x->hdr->nexts;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (x->exts[mid].blk <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || addr - x->exts[lo - 1].blk >= x->exts[lo - 1].n) return NULL;
+  return &x->exts[lo - 1];
+}
+
+// Answer whose block addr is
+void query_owner(index_t *x, uint64_t addr) {
+  index_hdr_t *h = x->hdr;
+  sb_t *sb = &h->sb;
+  idx_ext_t *o;
+  printf("block %llu: ", (unsigned long long)addr);
+  if (addr >= sb->size) {
+    printf("past the end of the image\n");
+  } else if (addr < h->firstblk) {
+    const char *what = addr == 0 ? "boot block" : addr == 1 ? "superblock" : "metadata";
+    if (addr >= sb->inodestart && addr < sb->inodestart + h->ninodeblks) what = "inode table";
+    if (addr >= sb->bmapstart && addr < sb->bmapstart + h->nbitmapblks) what = "bitmap";
+    if (sb->logstart != 0 && addr >= sb->logstart && addr < sb->logstart + sb->nlog) what = "log";
+    printf("%s\n", what);
+  } else if (sb->logstart == 0 && addr + sb->nlog >= sb->size) {
+    // The old layout keeps the log at the end of the image
+    printf("log\n");
+  } else if ((o = idx_find_ext(x, addr)) == NULL) {
+    printf("not in use\n");
+  } else {
+    if (o->height == 0) {
+      printf("inode %u, logical block %llu\n", o->inum,
+             (unsigned long long)(o->lblk + addr - o->blk));
+    } else {
+      printf("inode %u, indirect block %u level%s above logical block %llu\n", o->inum,
+             o->height, o->height == 1 ? "" : "s", (unsigned long long)o->lblk);
+    }
+    idx_put_paths(x, o->inum, "  ");
+  }
+}
+
+// List a directory's entries, or the one entry of a file
+void query_ls(index_t *x, uint inum) {
+  static const char *types[] = { "free", "dir", "file", "dev" };
+  idx_inode_t *in = &x->inodes[inum];
+  uint64_t k = in->ents, e = in->ents + in->nents;
+  if (in->type != T_DIR) {
+    k = in->link;
+    e = k + 1;
+  }
+  for (; k < e && k != ~0ULL; k++) {
+    idx_inode_t *c = &x->inodes[x->links[k].inum];
+    printf("%10u %-4s %5d %12llu  %s\n", x->links[k].inum,
+           c->type >= 0 && c->type <= T_DEV ? types[c->type] : "?", c->nlink,
+           (unsigned long long)c->size, x->links[k].name);
+  }
+}
+
+// Answer questions from a block ownership index: fcheck query <image> <index> owner
+// <block>..., path <inum|path>... or ls <inum|path>. The image's digest is computed
+// again, which takes the metadata reads of a check, and must match the index's. With
+// --trust-mtime, the index is trusted without it while the image file's size and
+// modification time are those it was built with.
+int query_main(int argc, char *argv[]) {
+  uint forced[3] = { 0, 0, 0 };
+  char *args[3];
+  int nargs = 0, a;
+  bool trust_mtime = false;
+  for (a = 1; a < argc && nargs < 3; a++) {
+    if (geo_opt(argc, argv, &a, forced)) continue;
+    if (strcmp(argv[a], "--trust-mtime") == 0) {
+      trust_mtime = true;
+      continue;
+    }
+    if (argv[a][0] == '-') break;
+    args[nargs++] = argv[a];
+  }
+  bool owner = nargs == 3 && strcmp(args[2], "owner") == 0;
+  bool path = nargs == 3 && strcmp(args[2], "path") == 0;
+  bool ls = nargs == 3 && strcmp(args[2], "ls") == 0;
+  if (!(owner || path || ls) || a == argc) {
+    fprintf(stderr, "Usage: fcheck query [--trust-mtime] [--bsize <n>] [--ndirect <n>] "
+            "[--levels <n>] <file_system_image> <index> owner <block>... | path <inum|path>... "
+            "| ls <inum|path>\n");
+    exit(1);
+  }
+
+  int fd = open(args[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(args[1]);
+    exit(1);
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  index_t x = { .hdr = (index_hdr_t *)map };
+  if (map == MAP_FAILED || (size_t)st.st_size < sizeof(index_hdr_t) ||
+      memcmp(x.hdr->magic, INDEX_MAGIC, sizeof(x.hdr->magic)) != 0 ||
+      !idx_valid(&x, st.st_size)) {
+    fprintf(stderr, "ERROR: not a block ownership index.\n");
+    fprintf(stderr, "  %s\n", args[1]);
+    exit(1);
+  }
+
+  if (stat(args[0], &st) != 0) {
+    perror(args[0]);
+    exit(1);
+  }
+  if (!trust_mtime || st.st_size != x.hdr->isize || st.st_mtim.tv_sec != x.hdr->mtime ||
+      st.st_mtim.tv_nsec != x.hdr->mtime_ns) {
+    img_t img;
+    open_img(&img, args[0], O_RDONLY, forced[0], forced[1], forced[2]);
+    ctx_t ctx = { .img = &img };
+    make_data(&ctx, D_DIRECT | D_INDIRECT);
+    if (img.sb.size != x.hdr->sb.size || img.sb.ninodes != x.hdr->sb.ninodes ||
+        image_digest(&ctx) != x.hdr->digest) {
+      fprintf(stderr, "ERROR: index is out of date.\n");
+      fprintf(stderr, "  rebuild it with fcheck --index %s %s\n", args[1], args[0]);
+      exit(1);
+    }
+  }
+
+  for (; a < argc; a++) {
+    if (owner) {
+      query_owner(&x, strtoull(argv[a], NULL, 0));
+      continue;
+    }
+    uint inum = idx_lookup(&x, argv[a]);
+    if (inum == 0 || x.inodes[inum].type == 0) {
+      fprintf(stderr, "ERROR: %s is not in use in the image.\n", argv[a]);
+      exit(1);
+    }
+    if (path) {
+      char prefix[32];
+      snprintf(prefix, sizeof(prefix), "%u: ", inum);
+      idx_put_paths(&x, inum, prefix);
+    } else {
+      query_ls(&x, inum);
+    }
+  }
+  return 0;
+}
+
+// State shared by the microbenchmarks: a synthetic in-memory image and its inputs
+typedef struct {
+  img_t img;
+  ctx_t ctx;
+  uint *probes;     // Random block addresses for bitmap tests
+  uint nprobes;
+  uint *dirblks;    // Blocks filled with directory entries
+  uint ndirblks;
+} bench_t;
+
+// One microbenchmark: a kernel run once per call, reporting the operations it performed
+// and the bytes it read so results can be given in ns/op and GB/s
+typedef struct {
+  const char *name;
+  uint64_t (*run)(bench_t *b, uint64_t *ops, uint64_t *bytes);
+} kernel_t;
+
+// Result of one microbenchmark
+typedef struct {
+  const char *name;
+  double ns_per_op;
+  double gbps;
+} bench_res_t;
+
+uint64_t bench_sink; // Keeps kernel results alive
+
+// Next value of a xorshift generator, so synthetic images are reproducible
+uint64_t bench_rand(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Draw true with the given probability
+bool bench_hit(uint64_t *state, double density) {
+  return (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0) < density;
+}
+
+// Build a synthetic image of the given geometry with ninodes allocated files (plus the
+// root) whose direct slots, indirect entries, bitmap bits and directory entries are
+// non-zero with the given density. Every inode has an indirect block; directory blocks
+// follow them.
+void bench_image(bench_t *b, geo_t *g, uint ninodes, double density) {
+  uint64_t rs = 0x9E3779B97F4A7C15ULL;
+  uint ndirblks = 1024;
+  uint ninodeblks = ninodes / g->ipb + 1;
+  uint size = 2 + ninodeblks + ninodes + ndirblks;
+  size += size / g->bpb + 1;
+
+  char *map = calloc((size_t)size, g->bsize);
+  struct superblock *sb = (struct superblock *)(map + g->bsize);
+  sb->size = size;
+  sb->ninodes = ninodes;
+  sb->nblocks = size - (2 + ninodeblks + size / g->bpb + 1);
+  init_img(&b->img, map, (off_t)size * g->bsize, g);
+  img_t *img = &b->img;
+  uint first = img->firstblk, ndata = size - first;
+
+  // Inodes, each with an indirect block right after the metadata
+  for (uint i = ROOTINO; i < ninodes; i++) {
+    struct dinode *in = inode_ptr(img, i);
+    uint *addrs = inode_addrs(g, in);
+    in->type = i == ROOTINO ? T_DIR : T_FILE;
+    in->nlink = 1;
+    for (uint j = 0; j < g->ndirect; j++) {
+      addrs[j] = bench_hit(&rs, density) ? first + bench_rand(&rs) % ndata : 0;
+    }
+    addrs[g->ndirect] = first + i;
+    uint *indirect = (uint *)blk_ptr(img, first + i);
+    for (uint j = 0; j < g->nindirect; j++) {
+      indirect[j] = bench_hit(&rs, density) ? first + bench_rand(&rs) % ndata : 0;
+    }
+  }
+
+  // Bitmap bits and random probes into it
+  for (uint a = 0; a < size; a++) {
+    if (bench_hit(&rs, density)) img->bitmapblks[a / 8] |= bits[a % 8];
+  }
+  b->nprobes = 1 << 20;
+  b->probes = malloc(b->nprobes * sizeof(uint));
+  for (uint k = 0; k < b->nprobes; k++) {
+    b->probes[k] = bench_rand(&rs) % size;
+  }
+
+  // Directory blocks, with '.' and '..' only where the walk expects them
+  b->ndirblks = ndirblks;
+  b->dirblks = malloc(ndirblks * sizeof(uint));
+  for (uint k = 0; k < ndirblks; k++) {
+    b->dirblks[k] = size - ndirblks + k;
+    struct dirent *de = (struct dirent *)blk_ptr(img, b->dirblks[k]);
+    for (uint j = 0; j < g->dpb; j++, de++) {
+      if (!bench_hit(&rs, density)) continue;
+      de->inum = 2 + bench_rand(&rs) % (ninodes - 2);
+      snprintf(de->name, DIRSIZ, "f%u", (uint)(bench_rand(&rs) % 100000));
+    }
+  }
+
+  // Inode columns and a reference map that agrees with the inodes
+  b->ctx.img = img;
+  run_alloc_list(&b->ctx);
+  b->ctx.refs.inmap = malloc(ninodes * sizeof(int));
+  b->ctx.refs.links = calloc(ninodes, sizeof(link_t));
+  for (uint i = 0; i < ninodes; i++) {
+    b->ctx.refs.inmap[i] = 1;
+  }
+}
+
+// Bitmap bit tests at random addresses
+uint64_t bk_bitmap_rand(bench_t *b, uint64_t *ops, uint64_t *bytes) {
+  uint64_t hits = 0;
+  for (uint k = 0; k < b->nprobes; k++) {
+    hits += marked_in_bmp(b->img.bitmapblks, b->probes[k]) != 0;
+  }
+  *ops = b->nprobes;
+  *bytes = b->nprobes;
+  return hits;
+}
+
+// Bitmap bit tests sweeping every block in order
+uint64_t bk_bitmap_seq(bench_t *b, uint64_t *ops, uint64_t *bytes) {
+  uint64_t hits = 0;
+  for (uint a = 0; a < b->img.sb.size; a++) {
+    hits += CHK_BIT(b->img.bitmapblks, a) != 0;
+  }
+  *ops = b->img.sb.size;
+  *bytes = b->img.sb.size / 8;
+  return hits;
+}
+
+// Indirect block decoding and validation
+uint64_t bk_indirect(bench_t *b, uint64_t *ops, uint64_t *bytes) {
+  uint64_t n = 0;
+  for (uint i = ROOTINO; i < b->img.sb.ninodes; i++) {
+    uint64_t slots[MAXLEVELS];
+    read_slots(&b->img.geo, inode_ptr(&b->img, i), slots);
+    n += check_indirect(&b->img, i, slots, NULL);
+  }
+  *ops = b->img.sb.ninodes - ROOTINO;
+  *bytes = *ops * b->img.geo.bsize;
+  return n;
+}
+
+// Directory entry scanning
+uint64_t bk_dirents(bench_t *b, uint64_t *ops, uint64_t *bytes) {
+  uint64_t n = 0;
+  for (uint k = 0; k < b->ndirblks; k++) {
+    bool dot = false, ddot = false;
+    n += process_entries(&b->img, b->dirblks[k], ROOTINO, &dot, &ddot);
+  }
+  *ops = (uint64_t)b->ndirblks * b->img.geo.dpb;
+  *bytes = (uint64_t)b->ndirblks * b->img.geo.bsize;
+  return n;
+}
+
+// Address validation across addrs[]
+uint64_t bk_valid_addr(bench_t *b, uint64_t *ops, uint64_t *bytes) {
+  uint64_t n = 0;
+  run_check_direct(&b->ctx);
+  for (uint k = 0; k < b->ctx.nalloc; k++) {
+    n += b->ctx.ndirect[k];
+  }
+  free(b->ctx.ndirect);
+  *ops = (uint64_t)b->ctx.nalloc * b->img.geo.ndirect;
+  *bytes = (uint64_t)b->ctx.nalloc * b->img.geo.isize;
+  return n;
+}
+
+// Reference count reconciliation against the reference map
+uint64_t bk_refcount(bench_t *b, uint64_t *ops, uint64_t *bytes) {
+  dir_chk(&b->ctx);
+  *ops = b->img.sb.ninodes - 2;
+  *bytes = *ops * (2 * sizeof(short) + sizeof(int));
+  return *ops;
+}
+
+kernel_t kernels[] = {
+  { "bitmap_rand",  bk_bitmap_rand },
+  { "bitmap_seq",   bk_bitmap_seq },
+  { "indirect",     bk_indirect },
+  { "dirents",      bk_dirents },
+  { "valid_addr",   bk_valid_addr },
+  { "refcount",     bk_refcount },
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+// Read the monotonic clock in nanoseconds
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Time a kernel, repeating it until at least min_ms have passed
+bench_res_t bench_kernel(bench_t *b, kernel_t *k, double min_ms) {
+  uint64_t ops = 0, bytes = 0, tops = 0, tbytes = 0;
+  bench_sink += k->run(b, &ops, &bytes); // Warm up
+  double start = now_ns(), elapsed;
+  do {
+    bench_sink += k->run(b, &ops, &bytes);
+    tops += ops;
+    tbytes += bytes;
+    elapsed = now_ns() - start;
+  } while (elapsed < min_ms * 1e6);
+  return (bench_res_t){ k->name, elapsed / tops, tbytes / elapsed };
+}
+
+// Look up a kernel's ns/op in a saved baseline, or return 0 if it is not there
+double baseline_ns(FILE *f, const char *name) {
+  char bname[64];
+  double ns, gbps;
+  rewind(f);
+  while (fscanf(f, "%63s %lf %lf", bname, &ns, &gbps) == 3) {
+    if (strcmp(bname, name) == 0) return ns;
+  }
+  return 0;
+}
+
+// Microbenchmarks of the checker's primitives on a synthetic in-memory image:
+// fcheck bench [--density <0..1>] [--inodes <n>] [--min-ms <ms>] [--save <file>]
+//              [--baseline <file>] [--bsize <n>] [--ndirect <n>] [--levels <n>]
+//              [--generic]
+int bench_main(int argc, char *argv[]) {
+  double density = 0.5, min_ms = 200;
+  uint ninodes = 1 << 16, bsize = BSIZE, ndirect = NDIRECT, nlevels = 1;
+  bool generic = false;
+  char *save = NULL, *base = NULL;
+
+  for (int a = 1; a < argc; a++) {
+    if (a + 1 < argc && strcmp(argv[a], "--density") == 0) {
+      density = atof(argv[++a]);
+    } else if (a + 1 < argc && strcmp(argv[a], "--inodes") == 0) {
+      ninodes = strtoul(argv[++a], NULL, 0);
+    } else if (a + 1 < argc && strcmp(argv[a], "--min-ms") == 0) {
+      min_ms = atof(argv[++a]);
+    } else if (a + 1 < argc && strcmp(argv[a], "--save") == 0) {
+      save = argv[++a];
+    } else if (a + 1 < argc && strcmp(argv[a], "--baseline") == 0) {
+      base = argv[++a];
+    } else if (a + 1 < argc && strcmp(argv[a], "--bsize") == 0) {
+      bsize = strtoul(argv[++a], NULL, 0);
+    } else if (a + 1 < argc && strcmp(argv[a], "--ndirect") == 0) {
+      ndirect = strtoul(argv[++a], NULL, 0);
+    } else if (a + 1 < argc && strcmp(argv[a], "--levels") == 0) {
+      nlevels = strtoul(argv[++a], NULL, 0);
+    } else if (strcmp(argv[a], "--generic") == 0) {
+      generic = true;
+    } else {
+      fprintf(stderr, "Usage: fcheck bench [--density <0..1>] [--inodes <n>] [--min-ms <ms>] "
+              "[--save <file>] [--baseline <file>] [--bsize <n>] [--ndirect <n>] "
+              "[--levels <n>] [--generic]\n");
+      exit(1);
+    }
+  }
+  geo_t geo;
+  if (ninodes < 3 || density < 0 || density > 1 || !set_geo(&geo, bsize, ndirect, nlevels, 4)) {
+    fprintf(stderr, "ERROR: bad benchmark parameters.\n");
+    exit(1);
+  }
+
+  FILE *basef = NULL, *savef = NULL;
+  if (base && (basef = fopen(base, "r")) == NULL) {
+    perror(base);
+    exit(1);
+  }
+  if (save && (savef = fopen(save, "w")) == NULL) {
+    perror(save);
+    exit(1);
+  }
+
+  // Kernels run on this thread, where a failing check would have no task to stop
+  task_t task = { 0 };
+  cur_task = &task;
+  errf = stderr;
+
+  bench_t b = { 0 };
+  bench_image(&b, &geo, ninodes, density);
+  if (generic) b.img.kern = &geo_kern_any;
+  printf("%-14s %10s %10s%s\n", "kernel", "ns/op", "GB/s", basef ? "   vs baseline" : "");
+  for (uint k = 0; k < NKERNELS; k++) {
+    bench_res_t r = bench_kernel(&b, &kernels[k], min_ms);
+    printf("%-14s %10.3f %10.3f", r.name, r.ns_per_op, r.gbps);
+    double ns = basef ? baseline_ns(basef, r.name) : 0;
+    if (ns > 0) printf("   %+7.1f%%", (r.ns_per_op - ns) / ns * 100);
+    printf("\n");
+    if (savef) fprintf(savef, "%s %.6f %.6f\n", r.name, r.ns_per_op, r.gbps);
+  }
+
+  if (basef) fclose(basef);
+  if (savef) fclose(savef);
+  return 0;
+}
+
+// Main function to load and check the file system image
+int main(int argc, char *argv[]) {
+  int fsfd;
+  img_t img;
+  int tier = TIER_FULL;
+  bool all = false, rebuild = false, fix = false, dry_run = false, report = false, json = false;
+  char *fname = NULL, *journal = NULL, *index = NULL, path[4096];
+  uint bsize = 0, ndirect = 0, nlevels = 0;
+
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return bench_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "undo") == 0) {
+    return undo_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "extract") == 0) {
+    return extract_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "du") == 0) {
+    return du_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "compact") == 0) {
+    return compact_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "query") == 0) {
+    return query_main(argc - 1, argv + 1);
+  }
+
+  // Basic argument check
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "--quick") == 0) {
+      tier = TIER_QUICK;
+    } else if (strcmp(argv[a], "--standard") == 0) {
+      tier = TIER_STANDARD;
+    } else if (strcmp(argv[a], "--full") == 0) {
+      tier = TIER_FULL;
+    } else if (strcmp(argv[a], "--all") == 0) {
+      all = true;
+    } else if (strcmp(argv[a], "--report") == 0 || strcmp(argv[a], "--report=json") == 0) {
+      report = true;
+      json = argv[a][8] == '=';
+    } else if (strcmp(argv[a], "--rebuild-bitmap") == 0) {
+      rebuild = true;
+    } else if (strcmp(argv[a], "--repair") == 0) {
+      fix = true;
+    } else if (strcmp(argv[a], "--dry-run") == 0) {
+      dry_run = true;
+    } else if (a + 1 < argc && strcmp(argv[a], "--journal") == 0) {
+      journal = argv[++a];
+    } else if (a + 1 < argc && strcmp(argv[a], "--index") == 0) {
+      index = argv[++a];
+    } else if (a + 1 < argc && strcmp(argv[a], "--bsize") == 0) {
+      bsize = strtoul(argv[++a], NULL, 0);
+    } else if (a + 1 < argc && strcmp(argv[a], "--ndirect") == 0) {
+      ndirect = strtoul(argv[++a], NULL, 0);
+    } else if (a + 1 < argc && strcmp(argv[a], "--levels") == 0) {
+      nlevels = strtoul(argv[++a], NULL, 0);
+    } else if (argv[a][0] != '-' && fname == NULL) {
+      fname = argv[a];
+    } else {
+      fname = NULL;
+      break;
+    }
+  }
+  if (fname == NULL || (dry_run && !rebuild && !fix) || (rebuild && fix) || (journal && !fix) ||
+      (index && (rebuild || fix))) {
+    fprintf(stderr, "Usage: fcheck [--quick|--standard|--full] [--all] [--report[=json]] "
+            "[--index <file>] [--rebuild-bitmap | --repair [--journal <file>]] [--dry-run] "
+            "[--bsize <n>] [--ndirect <n>] [--levels <n>] <file_system_image>\n"
+            "       fcheck bench [--density <0..1>] [--inodes <n>] [--min-ms <ms>] "
+            "[--save <file>] [--baseline <file>] [--bsize <n>] [--ndirect <n>] "
+            "[--levels <n>] [--generic]\n"
+            "       fcheck undo <file_system_image> [<undo_journal>]\n"
+            "       fcheck extract [--bsize <n>] [--ndirect <n>] [--levels <n>] "
+            "<file_system_image> <inum|path> <out>\n"
+            "       fcheck du [--top <n>] [--bsize <n>] [--ndirect <n>] [--levels <n>] "
+            "<file_system_image>\n"
+            "       fcheck compact [--bsize <n>] [--ndirect <n>] [--levels <n>] "
+            "<file_system_image> <out>\n"
+            "       fcheck query [--trust-mtime] [--bsize <n>] [--ndirect <n>] [--levels <n>] "
+            "<file_system_image> <index> owner <block>... | path <inum|path>... | ls <inum|path>\n");
+    exit(1);
+  }
+  if (journal == NULL) {
+    snprintf(path, sizeof(path), "%s.undo", fname);
+    journal = path;
+  }
+
+  // Open file system image, for writing only when it is to be changed
+  fsfd = open_img(&img, fname, (rebuild || fix) && !dry_run ? O_RDWR : O_RDONLY, bsize, ndirect,
+                  nlevels);
+
+  if (rebuild) {
+    rebuild_bitmap(&img, fsfd, dry_run);
+    exit(0);
+  }
+  if (fix) {
+    repair(&img, fsfd, journal, dry_run);
+    exit(0);
+  }
 
-  // Check bitmap and address usage
-  bmp_chk(&img);
-  addrs_chk(&img);
-  dir_chk(&img);
+  // Run the checks of the requested tier, gathering the statistics along the way when
+  // a report is wanted, and the block maps and walk an index is built from
+  ctx_t ctx = { .img = &img, .stats = report ? calloc(1, sizeof(stats_t)) : NULL };
+  run_checks(&ctx, tier, (report ? D_INDIRECT | D_REFS : 0) |
+             (index ? D_DIRECT | D_INDIRECT | D_REFS : 0), all);
+  if (report) print_report(&ctx, json);
+  if (index) write_index(&ctx, fsfd, index);
 
   exit(0);
 }